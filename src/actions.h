@@ -0,0 +1,299 @@
+#ifndef ACTIONS_H
+#define ACTIONS_H
+
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ACTIONS_MAX 16
+#define ACTIONS_MAX_RUNNING 4
+#define ACTION_COMMAND_MAX_LENGTH 255
+#define ACTION_CONTEXT_SIZE 16
+#define ACTION_LINE_MAX_LENGTH (ACTION_COMMAND_MAX_LENGTH + 64)
+
+extern char **environ;
+
+typedef enum {
+  ACTION_RESULT_STARTED,
+  ACTION_RESULT_SUCCESS,
+  ACTION_RESULT_FAILED,
+  ACTION_RESULT_TIMEOUT,
+  ACTION_RESULT_BUSY,
+  ACTION_RESULT_SPAWN_FAILED
+} ACTION_RESULT;
+
+const char* decode_action_result_short(ACTION_RESULT result) {
+  switch (result) {
+    case ACTION_RESULT_STARTED: return "started";
+    case ACTION_RESULT_SUCCESS: return "success";
+    case ACTION_RESULT_FAILED: return "failed";
+    case ACTION_RESULT_TIMEOUT: return "timeout";
+    case ACTION_RESULT_BUSY: return "busy";
+    case ACTION_RESULT_SPAWN_FAILED: return "spawn_failed";
+  }
+  assert(0);
+}
+
+// A host command bound to a ZCL command received on one of our endpoints
+typedef struct {
+  uint8_t endpoint;
+  uint16_t cluster_id;
+  uint8_t command_id;
+  unsigned int timeout_ms;
+  char command[ACTION_COMMAND_MAX_LENGTH+1];
+} action_t;
+
+typedef void (*action_done_fn)(
+  const action_t *action,
+  ACTION_RESULT result,
+  int exit_status,
+  void *context
+);
+
+typedef struct {
+  pid_t pid;
+  const action_t *action;
+  struct timespec deadline;
+  bool timed_out;
+  action_done_fn on_done;
+  // Copied from the caller so that it outlives the ZCL command that
+  // started the action
+  uint8_t context[ACTION_CONTEXT_SIZE];
+} action_slot_t;
+
+typedef struct {
+  action_t actions[ACTIONS_MAX];
+  size_t actions_count;
+  action_slot_t running[ACTIONS_MAX_RUNNING];
+  int signal_fd;
+} action_executor_t;
+
+/*
+ * Blocks SIGCHLD and creates a non blocking signalfd for it, so that
+ * children exiting are noticed from the super loop instead of a signal
+ * handler. Call before any other thread is started.
+ */
+bool actions_init(action_executor_t *executor) {
+  memset(executor, 0, sizeof(*executor));
+  executor->signal_fd = -1;
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  if (sigprocmask(SIG_BLOCK, &mask, NULL) != 0) {
+    return false;
+  }
+  executor->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  return executor->signal_fd != -1;
+}
+
+/*
+ * Parses a single line of the actions file, with the format:
+ * ```
+ * <endpoint> <cluster id> <command id> <timeout ms> <shell command>
+ * ```
+ * Numbers can be given in decimal or hex (`0x` prefix). Returns false
+ * if the line is malformed.
+ */
+bool parse_action(const char *line, action_t *action) {
+  int endpoint, cluster_id, command_id;
+  unsigned int timeout_ms;
+  int command_start = 0;
+  if (sscanf(line, "%i %i %i %u %n", &endpoint, &cluster_id, &command_id,
+             &timeout_ms, &command_start) < 4 || command_start == 0) {
+    return false;
+  }
+  if (endpoint < 0 || endpoint > 0xFF || cluster_id < 0 ||
+      cluster_id > 0xFFFF || command_id < 0 || command_id > 0xFF) {
+    return false;
+  }
+  const char *command = line + command_start;
+  size_t command_len = strcspn(command, "\n");
+  if (command_len == 0 || command_len > ACTION_COMMAND_MAX_LENGTH) {
+    return false;
+  }
+  action->endpoint = endpoint;
+  action->cluster_id = cluster_id;
+  action->command_id = command_id;
+  action->timeout_ms = timeout_ms;
+  memcpy(action->command, command, command_len);
+  action->command[command_len] = '\0';
+  return true;
+}
+
+/*
+ * Loads actions from `file`, skipping blank lines and lines starting
+ * with `#`. Returns false and sets `bad_line` to the (1 based) number of
+ * the first line that couldn't be parsed, or that exceeded `ACTIONS_MAX`.
+ */
+bool actions_load(action_executor_t *executor, FILE *file, int *bad_line) {
+  char line[ACTION_LINE_MAX_LENGTH+1];
+  int line_number = 0;
+  while (fgets(line, sizeof(line), file)) {
+    line_number++;
+    const char *start = line + strspn(line, " \t");
+    if (*start == '#' || *start == '\n' || *start == '\0') {
+      continue;
+    }
+    if (executor->actions_count >= ACTIONS_MAX ||
+        !parse_action(start, &executor->actions[executor->actions_count])) {
+      *bad_line = line_number;
+      return false;
+    }
+    executor->actions_count++;
+  }
+  return true;
+}
+
+const action_t* actions_find(const action_executor_t *executor,
+                             uint8_t endpoint, uint16_t cluster_id,
+                             uint8_t command_id) {
+  for (size_t i = 0; i < executor->actions_count; i++) {
+    const action_t *action = &executor->actions[i];
+    if (action->endpoint == endpoint && action->cluster_id == cluster_id &&
+        action->command_id == command_id) {
+      return action;
+    }
+  }
+  return NULL;
+}
+
+size_t actions_running(const action_executor_t *executor) {
+  size_t running = 0;
+  for (size_t i = 0; i < ACTIONS_MAX_RUNNING; i++) {
+    if (executor->running[i].pid != 0) {
+      running++;
+    }
+  }
+  return running;
+}
+
+/*
+ * Launches `action` with `/bin/sh -c` in its own process group and
+ * returns immediately. `on_done` is called from `actions_poll` once the
+ * command exits or gets killed for exceeding its timeout. Returns
+ * `ACTION_RESULT_STARTED` on success, in which case `on_done` is
+ * guaranteed to be called later, otherwise `on_done` is never called.
+ */
+ACTION_RESULT actions_start(action_executor_t *executor,
+                            const action_t *action, action_done_fn on_done,
+                            const void *context, size_t context_size) {
+  assert(context_size <= ACTION_CONTEXT_SIZE);
+  action_slot_t *slot = NULL;
+  for (size_t i = 0; i < ACTIONS_MAX_RUNNING; i++) {
+    if (executor->running[i].pid == 0) {
+      slot = &executor->running[i];
+      break;
+    }
+  }
+  if (!slot) {
+    return ACTION_RESULT_BUSY;
+  }
+
+  // The child must not inherit our blocked SIGCHLD, nor the ignored
+  // SIGPIPE, which survives exec and breaks pipelines in the command
+  posix_spawnattr_t attr;
+  sigset_t no_signals, default_signals;
+  sigemptyset(&no_signals);
+  sigemptyset(&default_signals);
+  sigaddset(&default_signals, SIGCHLD);
+  sigaddset(&default_signals, SIGPIPE);
+  if (posix_spawnattr_init(&attr) != 0) {
+    return ACTION_RESULT_SPAWN_FAILED;
+  }
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+                                  POSIX_SPAWN_SETSIGDEF |
+                                  POSIX_SPAWN_SETPGROUP);
+  posix_spawnattr_setsigmask(&attr, &no_signals);
+  posix_spawnattr_setsigdefault(&attr, &default_signals);
+  posix_spawnattr_setpgroup(&attr, 0);
+
+  char *const argv[] = {"sh", "-c", (char*)action->command, NULL};
+  pid_t pid;
+  int spawn_error = posix_spawn(&pid, "/bin/sh", NULL, &attr, argv, environ);
+  posix_spawnattr_destroy(&attr);
+  if (spawn_error != 0) {
+    errno = spawn_error;
+    return ACTION_RESULT_SPAWN_FAILED;
+  }
+
+  slot->pid = pid;
+  slot->action = action;
+  slot->timed_out = false;
+  slot->on_done = on_done;
+  memcpy(slot->context, context, context_size);
+  clock_gettime(CLOCK_MONOTONIC, &slot->deadline);
+  slot->deadline.tv_sec += action->timeout_ms / 1000;
+  slot->deadline.tv_nsec += (long)(action->timeout_ms % 1000) * 1000000L;
+  if (slot->deadline.tv_nsec >= 1000000000L) {
+    slot->deadline.tv_sec++;
+    slot->deadline.tv_nsec -= 1000000000L;
+  }
+  return ACTION_RESULT_STARTED;
+}
+
+static bool timespec_passed(const struct timespec *now,
+                            const struct timespec *deadline) {
+  return now->tv_sec > deadline->tv_sec ||
+         (now->tv_sec == deadline->tv_sec && now->tv_nsec >= deadline->tv_nsec);
+}
+
+/*
+ * Reaps finished children and kills the ones that went over their
+ * timeout. Never blocks, meant to be called on every iteration of the
+ * super loop.
+ */
+void actions_poll(action_executor_t *executor) {
+  // SIGCHLD doesn't queue, one pending signal may stand for several
+  // children, so the signalfd is only used to know when to check
+  bool children_exited = false;
+  struct signalfd_siginfo info;
+  while (read(executor->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+    children_exited = true;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  for (size_t i = 0; i < ACTIONS_MAX_RUNNING; i++) {
+    action_slot_t *slot = &executor->running[i];
+    if (slot->pid == 0) {
+      continue;
+    }
+    if (children_exited) {
+      int status;
+      if (waitpid(slot->pid, &status, WNOHANG) == slot->pid) {
+        ACTION_RESULT result;
+        int exit_status = -1;
+        if (slot->timed_out) {
+          result = ACTION_RESULT_TIMEOUT;
+        } else if (WIFEXITED(status)) {
+          exit_status = WEXITSTATUS(status);
+          result = exit_status == 0 ?
+            ACTION_RESULT_SUCCESS : ACTION_RESULT_FAILED;
+        } else {
+          result = ACTION_RESULT_FAILED;
+        }
+        slot->pid = 0;
+        slot->on_done(slot->action, result, exit_status, slot->context);
+        continue;
+      }
+    }
+    if (!slot->timed_out && timespec_passed(&now, &slot->deadline)) {
+      // Kill the whole group, `sh -c` may have forked the actual command
+      slot->timed_out = true;
+      kill(-slot->pid, SIGKILL);
+    }
+  }
+}
+
+#endif /* ACTIONS_H */
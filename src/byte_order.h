@@ -0,0 +1,33 @@
+#ifndef BYTE_ORDER_H
+#define BYTE_ORDER_H
+
+#include <stdint.h>
+
+// Little endian helpers for the file and wire formats, these advance
+// past what they wrote or read
+
+uint8_t* put_le16(uint8_t *out, uint16_t value) {
+  out[0] = value & 0xFF;
+  out[1] = value >> 8;
+  return out + 2;
+}
+
+uint8_t* put_le32(uint8_t *out, uint32_t value) {
+  out = put_le16(out, value & 0xFFFF);
+  return put_le16(out, value >> 16);
+}
+
+const uint8_t* get_le16(const uint8_t *in, uint16_t *value) {
+  *value = (uint16_t)(in[0] | (in[1] << 8));
+  return in + 2;
+}
+
+const uint8_t* get_le32(const uint8_t *in, uint32_t *value) {
+  uint16_t low, high;
+  in = get_le16(in, &low);
+  in = get_le16(in, &high);
+  *value = low | ((uint32_t)high << 16);
+  return in;
+}
+
+#endif /* BYTE_ORDER_H */
@@ -0,0 +1,408 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "byte_order.h"
+
+#define CAPTURE_RING_SIZE 256
+#define CAPTURE_MAX_PAYLOAD 128
+#define CAPTURE_BATCH_SIZE (32 * 1024)
+#define CAPTURE_FLUSH_SIZE (CAPTURE_BATCH_SIZE / 2)
+#define CAPTURE_FLUSH_INTERVAL_MS 500
+#define CAPTURE_ROTATE_SIZE (16 * 1024 * 1024)
+#define CAPTURE_PATH_MAX_LENGTH 255
+#define CAPTURE_ROTATED_SUFFIX ".1"
+
+// IEEE 802.15.4 with a TAP header carrying the RSSI and LQI
+#define CAPTURE_LINKTYPE_IEEE802_15_4_TAP 283
+#define CAPTURE_TAP_HEADER_SIZE 28
+#define CAPTURE_MAC_HEADER_SIZE 9
+#define CAPTURE_NWK_HEADER_SIZE 8
+#define CAPTURE_APS_HEADER_MAX_SIZE 9
+#define CAPTURE_PCAP_RECORD_HEADER_SIZE 16
+#define CAPTURE_RECORD_MAX_SIZE                                    \
+  (CAPTURE_PCAP_RECORD_HEADER_SIZE + CAPTURE_TAP_HEADER_SIZE +     \
+   CAPTURE_MAC_HEADER_SIZE + CAPTURE_NWK_HEADER_SIZE +             \
+   CAPTURE_APS_HEADER_MAX_SIZE + CAPTURE_MAX_PAYLOAD)
+
+#define CAPTURE_BROADCAST_ADDRESS 0xFFFF
+#define CAPTURE_NWK_DEFAULT_RADIUS 0x1E
+
+typedef enum {
+  CAPTURE_DELIVERY_UNICAST,
+  CAPTURE_DELIVERY_BROADCAST,
+  CAPTURE_DELIVERY_GROUP
+} CAPTURE_DELIVERY;
+
+// An incoming APS frame as received from the NCP, which has already
+// stripped the MAC and NWK headers and decrypted it
+typedef struct {
+  struct timespec timestamp;
+  CAPTURE_DELIVERY delivery;
+  uint16_t sender;
+  int8_t rssi;
+  uint8_t lqi;
+  uint16_t profile_id;
+  uint16_t cluster_id;
+  uint16_t group_id;
+  uint8_t source_endpoint;
+  uint8_t destination_endpoint;
+  uint8_t sequence;
+  uint8_t length;
+  uint8_t payload[CAPTURE_MAX_PAYLOAD];
+} capture_frame_t;
+
+typedef struct {
+  uint32_t captured;
+  // Frames lost because the ring was full
+  uint32_t dropped;
+  // Frames with payloads longer than CAPTURE_MAX_PAYLOAD, written cut short
+  uint32_t truncated;
+  uint32_t bytes_written;
+  uint32_t rotations;
+} capture_stats_t;
+
+/*
+ * Frames are copied into the ring from the stack callbacks and drained
+ * from the super loop, both on the same thread, so plain indexes are
+ * enough. `head` and `tail` run freely and get wrapped on access.
+ */
+typedef struct {
+  capture_frame_t ring[CAPTURE_RING_SIZE];
+  uint32_t head;
+  uint32_t tail;
+  int fd;
+  bool is_fifo;
+  char path[CAPTURE_PATH_MAX_LENGTH+1];
+  size_t file_size;
+  uint8_t batch[CAPTURE_BATCH_SIZE];
+  size_t batch_length;
+  size_t batch_written;
+  uint32_t last_flush_ms;
+  uint16_t pan_id;
+  uint16_t node_id;
+  uint8_t mac_sequence;
+  uint8_t nwk_sequence;
+  capture_stats_t stats;
+} capture_t;
+
+// pcap headers are written in host byte order, readers detect it from
+// the magic number
+static uint8_t* capture_put_host32(uint8_t *out, uint32_t value) {
+  memcpy(out, &value, sizeof(value));
+  return out + sizeof(value);
+}
+
+void capture_init(capture_t *capture) {
+  memset(capture, 0, sizeof(*capture));
+  capture->fd = -1;
+}
+
+bool capture_active(const capture_t *capture) {
+  return capture->fd != -1;
+}
+
+static bool capture_write_file_header(capture_t *capture) {
+  uint8_t header[24];
+  uint8_t *out = header;
+  out = capture_put_host32(out, 0xA1B2C3D4);
+  uint16_t version[2] = {2, 4};
+  memcpy(out, version, sizeof(version));
+  out += sizeof(version);
+  out = capture_put_host32(out, 0);
+  out = capture_put_host32(out, 0);
+  out = capture_put_host32(out, 0xFFFF);
+  out = capture_put_host32(out, CAPTURE_LINKTYPE_IEEE802_15_4_TAP);
+  // Only done right after opening, a reader on a fifo has an empty pipe
+  // buffer to fit this in
+  if (write(capture->fd, header, sizeof(header)) != sizeof(header)) {
+    return false;
+  }
+  capture->file_size = sizeof(header);
+  capture->stats.bytes_written += sizeof(header);
+  return true;
+}
+
+static bool capture_open(capture_t *capture) {
+  struct stat st;
+  capture->is_fifo = stat(capture->path, &st) == 0 && S_ISFIFO(st.st_mode);
+  int flags = capture->is_fifo ?
+    O_WRONLY | O_NONBLOCK | O_CLOEXEC :
+    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+  capture->fd = open(capture->path, flags, 0644);
+  if (capture->fd == -1) {
+    return false;
+  }
+  if (!capture_write_file_header(capture)) {
+    int write_errno = errno;
+    close(capture->fd);
+    capture->fd = -1;
+    errno = write_errno;
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Starts writing captured frames to `path`. If it's a fifo (to be read
+ * by `wireshark -k -i <path>`) the reader must already have it open.
+ * Otherwise it's truncated, and rotated to `<path>.1` every
+ * `CAPTURE_ROTATE_SIZE` bytes. Returns false and sets errno on failure.
+ */
+bool capture_start(capture_t *capture, const char *path, uint16_t pan_id,
+                   uint16_t node_id, uint32_t now_ms) {
+  if (capture_active(capture)) {
+    errno = EBUSY;
+    return false;
+  }
+  if (strlen(path) > CAPTURE_PATH_MAX_LENGTH) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  strcpy(capture->path, path);
+  memset(&capture->stats, 0, sizeof(capture->stats));
+  capture->head = capture->tail = 0;
+  capture->batch_length = capture->batch_written = 0;
+  capture->pan_id = pan_id;
+  capture->node_id = node_id;
+  capture->last_flush_ms = now_ms;
+  return capture_open(capture);
+}
+
+static void capture_close(capture_t *capture) {
+  if (capture_active(capture)) {
+    close(capture->fd);
+    capture->fd = -1;
+  }
+}
+
+/*
+ * Returns a slot in the ring for the caller to fill in, with the
+ * timestamp already set, or NULL if the capture isn't running or the
+ * ring is full. Must be followed by `capture_commit`.
+ */
+capture_frame_t* capture_reserve(capture_t *capture) {
+  if (!capture_active(capture)) {
+    return NULL;
+  }
+  if (capture->head - capture->tail >= CAPTURE_RING_SIZE) {
+    capture->stats.dropped++;
+    return NULL;
+  }
+  capture_frame_t *frame = &capture->ring[capture->head % CAPTURE_RING_SIZE];
+  clock_gettime(CLOCK_REALTIME, &frame->timestamp);
+  return frame;
+}
+
+void capture_commit(capture_t *capture) {
+  capture->head++;
+  capture->stats.captured++;
+}
+
+/*
+ * Copies `length` bytes of payload into the frame, cutting it short
+ * if it doesn't fit.
+ */
+void capture_set_payload(capture_t *capture, capture_frame_t *frame,
+                         const uint8_t *payload, size_t length) {
+  if (length > CAPTURE_MAX_PAYLOAD) {
+    capture->stats.truncated++;
+    length = CAPTURE_MAX_PAYLOAD;
+  }
+  memcpy(frame->payload, payload, length);
+  frame->length = length;
+}
+
+static uint8_t* capture_put_tap_header(uint8_t *out,
+                                       const capture_frame_t *frame) {
+  out[0] = 0;  // version
+  out[1] = 0;  // reserved
+  out = put_le16(out + 2, CAPTURE_TAP_HEADER_SIZE);
+  // FCS type TLV: the NCP doesn't hand us the FCS
+  out = put_le16(out, 0);
+  out = put_le16(out, 1);
+  out = put_le32(out, 0);
+  // RSS TLV, dBm as a float
+  float rssi = frame->rssi;
+  uint32_t rssi_bits;
+  memcpy(&rssi_bits, &rssi, sizeof(rssi_bits));
+  out = put_le16(out, 1);
+  out = put_le16(out, 4);
+  out = put_le32(out, rssi_bits);
+  // LQI TLV
+  out = put_le16(out, 10);
+  out = put_le16(out, 1);
+  return put_le32(out, frame->lqi);
+}
+
+/*
+ * Encodes the frame as a pcap record, rebuilding the MAC, NWK and
+ * (unsecured) APS headers so that Wireshark dissects it all the way to
+ * ZCL. The sender stands in for the MAC source, which the NCP doesn't
+ * report. `out` must have CAPTURE_RECORD_MAX_SIZE bytes available.
+ * Returns the length of the record.
+ */
+size_t capture_encode_record(capture_t *capture, const capture_frame_t *frame,
+                             uint8_t *out) {
+  uint8_t *record = out;
+  uint8_t *packet = out + CAPTURE_PCAP_RECORD_HEADER_SIZE;
+  out = capture_put_tap_header(packet, frame);
+
+  uint16_t destination = frame->delivery == CAPTURE_DELIVERY_UNICAST ?
+    capture->node_id : CAPTURE_BROADCAST_ADDRESS;
+  // Data frame, PAN ID compression, short addresses
+  out = put_le16(out, 0x8841);
+  *out++ = capture->mac_sequence++;
+  out = put_le16(out, capture->pan_id);
+  out = put_le16(out, destination);
+  out = put_le16(out, frame->sender);
+
+  // Data frame, protocol version 2
+  out = put_le16(out, 0x0008);
+  out = put_le16(out, destination);
+  out = put_le16(out, frame->sender);
+  *out++ = CAPTURE_NWK_DEFAULT_RADIUS;
+  *out++ = capture->nwk_sequence++;
+
+  switch (frame->delivery) {
+    case CAPTURE_DELIVERY_UNICAST:
+      *out++ = 0x00;
+      *out++ = frame->destination_endpoint;
+      break;
+    case CAPTURE_DELIVERY_BROADCAST:
+      *out++ = 0x08;
+      *out++ = frame->destination_endpoint;
+      break;
+    case CAPTURE_DELIVERY_GROUP:
+      *out++ = 0x0C;
+      out = put_le16(out, frame->group_id);
+      break;
+  }
+  out = put_le16(out, frame->cluster_id);
+  out = put_le16(out, frame->profile_id);
+  *out++ = frame->source_endpoint;
+  *out++ = frame->sequence;
+
+  memcpy(out, frame->payload, frame->length);
+  out += frame->length;
+
+  uint32_t packet_length = out - packet;
+  uint8_t *header = record;
+  header = capture_put_host32(header, frame->timestamp.tv_sec);
+  header = capture_put_host32(header, frame->timestamp.tv_nsec / 1000);
+  header = capture_put_host32(header, packet_length);
+  capture_put_host32(header, packet_length);
+  return out - record;
+}
+
+static bool capture_rotate(capture_t *capture) {
+  char rotated_path[CAPTURE_PATH_MAX_LENGTH+sizeof(CAPTURE_ROTATED_SUFFIX)];
+  snprintf(rotated_path, sizeof(rotated_path), "%s%s", capture->path,
+           CAPTURE_ROTATED_SUFFIX);
+  capture_close(capture);
+  if (rename(capture->path, rotated_path) != 0) {
+    return false;
+  }
+  capture->stats.rotations++;
+  return capture_open(capture);
+}
+
+static void capture_fill_batch(capture_t *capture) {
+  while (capture->tail != capture->head &&
+         CAPTURE_BATCH_SIZE - capture->batch_length >= CAPTURE_RECORD_MAX_SIZE) {
+    capture->batch_length += capture_encode_record(
+      capture,
+      &capture->ring[capture->tail % CAPTURE_RING_SIZE],
+      capture->batch + capture->batch_length
+    );
+    capture->tail++;
+  }
+}
+
+/*
+ * Writes what it can of the batch, rotating the file first if needed.
+ * Writes that would block leave the rest pending. Returns false and
+ * sets errno on errors, the file may be closed by then.
+ */
+static bool capture_write_batch(capture_t *capture) {
+  size_t pending = capture->batch_length - capture->batch_written;
+  if (!capture->is_fifo && capture->batch_written == 0 &&
+      capture->file_size + pending > CAPTURE_ROTATE_SIZE &&
+      !capture_rotate(capture)) {
+    return false;
+  }
+
+  ssize_t written = write(capture->fd, capture->batch + capture->batch_written,
+                          pending);
+  if (written == -1) {
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+  }
+  capture->batch_written += written;
+  capture->file_size += written;
+  capture->stats.bytes_written += written;
+  if (capture->batch_written == capture->batch_length) {
+    capture->batch_length = capture->batch_written = 0;
+  }
+  return true;
+}
+
+/*
+ * Writes out every frame still in the ring or the batch and closes the
+ * file. Writes to files block until done, while a fifo only gets what
+ * fits in its pipe buffer.
+ */
+void capture_stop(capture_t *capture) {
+  while (capture_active(capture)) {
+    capture_fill_batch(capture);
+    if (capture->batch_length == 0) {
+      break;
+    }
+    uint32_t bytes_written = capture->stats.bytes_written;
+    if (!capture_write_batch(capture) ||
+        capture->stats.bytes_written == bytes_written) {
+      break;
+    }
+  }
+  capture_close(capture);
+}
+
+/*
+ * Drains the ring into the batch buffer and writes the batch out once
+ * it's large enough or `CAPTURE_FLUSH_INTERVAL_MS` went by. Writes that
+ * would block are retried on the next call, while the ring keeps
+ * filling up. Returns false and stops the capture on write errors,
+ * like the fifo reader going away.
+ */
+bool capture_poll(capture_t *capture, uint32_t now_ms) {
+  if (!capture_active(capture)) {
+    return true;
+  }
+  capture_fill_batch(capture);
+
+  size_t pending = capture->batch_length - capture->batch_written;
+  if (pending == 0 ||
+      (capture->batch_length < CAPTURE_FLUSH_SIZE &&
+       now_ms - capture->last_flush_ms < CAPTURE_FLUSH_INTERVAL_MS)) {
+    return true;
+  }
+  capture->last_flush_ms = now_ms;
+
+  if (!capture_write_batch(capture)) {
+    int write_errno = errno;
+    capture_close(capture);
+    errno = write_errno;
+    return false;
+  }
+  return true;
+}
+
+#endif /* CAPTURE_H */
@@ -0,0 +1,171 @@
+#ifndef EZSP_ROUTER_CLIENT_H
+#define EZSP_ROUTER_CLIENT_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../control_protocol.h"
+
+#define EZSP_ROUTER_CLIENT_LINE_MAX_LENGTH 1023
+
+/*
+ * Client for the binary control protocol, talking to the router over
+ * its fifos. Keep the client open for as long as binary mode is wanted,
+ * the router goes back to text once the input fifo is closed.
+ */
+typedef struct {
+  // The router's input fifo, for us to write to
+  int command_fd;
+  // The router's output fifo, for us to read from
+  int event_fd;
+  control_parser_t parser;
+} ezsp_router_client_t;
+
+static bool ezsp_router_client_write_all(int fd, const void *data,
+                                         size_t length) {
+  const uint8_t *bytes = data;
+  while (length > 0) {
+    ssize_t written = write(fd, bytes, length);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    bytes += written;
+    length -= written;
+  }
+  return true;
+}
+
+/*
+ * Reads a text line a byte at a time, so that nothing after it, like
+ * binary frames, is consumed. The newline is stripped.
+ */
+static bool ezsp_router_client_read_line(int fd, char *line, size_t size) {
+  size_t length = 0;
+  while (true) {
+    char c;
+    ssize_t got = read(fd, &c, 1);
+    if (got == -1 && errno == EINTR) {
+      continue;
+    }
+    if (got != 1) {
+      return false;
+    }
+    if (c == '\n') {
+      line[length] = '\0';
+      return true;
+    }
+    if (length + 1 < size) {
+      line[length++] = c;
+    }
+  }
+}
+
+/*
+ * Opens the fifos of the router running in `dir` and switches to binary
+ * mode. Text events sent by the router before it switched are skipped.
+ */
+bool ezsp_router_client_open(ezsp_router_client_t *client, const char *dir) {
+  char path[PATH_MAX];
+  control_parser_init(&client->parser);
+  client->command_fd = client->event_fd = -1;
+  snprintf(path, sizeof(path), "%s/ezsp_router.out", dir);
+  client->event_fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (client->event_fd == -1) {
+    return false;
+  }
+  snprintf(path, sizeof(path), "%s/ezsp_router.in", dir);
+  client->command_fd = open(path, O_WRONLY | O_CLOEXEC);
+  if (client->command_fd == -1) {
+    close(client->event_fd);
+    return false;
+  }
+
+  char expected[32];
+  snprintf(expected, sizeof(expected), "binary ok %d",
+           CONTROL_PROTOCOL_VERSION);
+  char request[32];
+  int request_length = snprintf(request, sizeof(request), "binary %d\n",
+                                CONTROL_PROTOCOL_VERSION);
+  if (ezsp_router_client_write_all(client->command_fd, request,
+                                   request_length)) {
+    char line[EZSP_ROUTER_CLIENT_LINE_MAX_LENGTH+1];
+    while (ezsp_router_client_read_line(client->event_fd, line, sizeof(line))) {
+      if (strcmp(line, expected) == 0) {
+        return true;
+      }
+      if (strncmp(line, "binary ", 7) == 0) {
+        errno = EPROTONOSUPPORT;
+        break;
+      }
+    }
+  }
+  int saved_errno = errno;
+  close(client->command_fd);
+  close(client->event_fd);
+  errno = saved_errno;
+  return false;
+}
+
+// Runs a command, the same ones accepted in text mode
+bool ezsp_router_client_command(ezsp_router_client_t *client,
+                                const char *command) {
+  size_t length = strlen(command);
+  if (length > CONTROL_MAX_VALUE_LENGTH) {
+    errno = EMSGSIZE;
+    return false;
+  }
+  uint8_t frame[CONTROL_FRAME_MAX_SIZE];
+  size_t frame_size = control_encode(frame, CONTROL_MSG_COMMAND, command,
+                                     length);
+  return ezsp_router_client_write_all(client->command_fd, frame, frame_size);
+}
+
+/*
+ * Blocks until the next event arrives. The message's value stays valid
+ * until the next call. Returns false on errors or if the router closed
+ * the fifo. Events too long to parse fail with EPROTO and are skipped by
+ * the next call.
+ */
+bool ezsp_router_client_next_event(ezsp_router_client_t *client,
+                                   control_message_t *message) {
+  while (true) {
+    switch (control_parser_next(&client->parser, message)) {
+      case CONTROL_PARSE_MESSAGE:
+        return true;
+      case CONTROL_PARSE_TOO_LONG:
+        errno = EPROTO;
+        return false;
+      case CONTROL_PARSE_NEED_MORE:
+        break;
+    }
+    size_t available;
+    uint8_t *space = control_parser_space(&client->parser, &available);
+    ssize_t got = read(client->event_fd, space, available);
+    if (got == -1 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      return false;
+    }
+    control_parser_fill(&client->parser, got);
+  }
+}
+
+// Switches the router back to text mode and closes the fifos
+void ezsp_router_client_close(ezsp_router_client_t *client) {
+  uint8_t frame[CONTROL_HEADER_SIZE];
+  size_t frame_size = control_encode(frame, CONTROL_MSG_TEXT_MODE, NULL, 0);
+  (void) ezsp_router_client_write_all(client->command_fd, frame, frame_size);
+  close(client->command_fd);
+  close(client->event_fd);
+}
+
+#endif /* EZSP_ROUTER_CLIENT_H */
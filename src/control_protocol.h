@@ -0,0 +1,321 @@
+#ifndef CONTROL_PROTOCOL_H
+#define CONTROL_PROTOCOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "byte_order.h"
+
+/*
+ * Binary framing for the control fifos, enabled by sending `binary 1` as
+ * a text command and waiting for the `binary ok 1` line. Every message
+ * is then a TLV:
+ * ```
+ * | type (1) | length (2, little endian) | value (length) |
+ * ```
+ * Events have fixed layouts, with every field in little endian.
+ */
+
+#define CONTROL_PROTOCOL_VERSION 1
+#define CONTROL_HEADER_SIZE 3
+// Same as the limit for text commands
+#define CONTROL_MAX_VALUE_LENGTH 1023
+#define CONTROL_FRAME_MAX_SIZE (CONTROL_HEADER_SIZE + CONTROL_MAX_VALUE_LENGTH)
+
+typedef enum {
+  // Client to router
+  CONTROL_MSG_COMMAND = 0x01,
+  CONTROL_MSG_TEXT_MODE = 0x02,
+  // Router to client
+  CONTROL_MSG_TEXT_EVENT = 0x80,
+  CONTROL_MSG_STATE = 0x81,
+  CONTROL_MSG_ACTION = 0x82,
+  CONTROL_MSG_NEIGHBOR = 0x83,
+  CONTROL_MSG_CAPTURE_STATS = 0x84
+} CONTROL_MSG_TYPE;
+
+/*
+ * Values of the state and action events. They're part of the protocol,
+ * so they stay the same whatever the router's own enums turn into. Only
+ * add new ones at the end.
+ */
+typedef enum {
+  CONTROL_STATE_UNKNOWN = 0,
+  CONTROL_STATE_DISCONNECTED = 1,
+  CONTROL_STATE_RECONNECTING = 2,
+  CONTROL_STATE_NO_NETWORK = 3,
+  CONTROL_STATE_SCANNING = 4,
+  CONTROL_STATE_SCANNED = 5,
+  CONTROL_STATE_JOINING = 6,
+  CONTROL_STATE_CONNECTED = 7,
+  CONTROL_STATE_HALTED = 8
+} CONTROL_STATE;
+
+typedef enum {
+  CONTROL_ACTION_RESULT_STARTED = 0,
+  CONTROL_ACTION_RESULT_SUCCESS = 1,
+  CONTROL_ACTION_RESULT_FAILED = 2,
+  CONTROL_ACTION_RESULT_TIMEOUT = 3,
+  CONTROL_ACTION_RESULT_BUSY = 4,
+  CONTROL_ACTION_RESULT_SPAWN_FAILED = 5
+} CONTROL_ACTION_RESULT;
+
+#define CONTROL_STATE_EVENT_SIZE 2
+#define CONTROL_ACTION_EVENT_SIZE 9
+#define CONTROL_NEIGHBOR_EVENT_SIZE 7
+#define CONTROL_CAPTURE_STATS_EVENT_SIZE 20
+
+// Points into the buffer it was parsed from
+typedef struct {
+  uint8_t type;
+  uint16_t length;
+  const uint8_t *value;
+} control_message_t;
+
+typedef struct {
+  uint8_t prev_state;
+  uint8_t new_state;
+} control_state_event_t;
+
+typedef struct {
+  uint8_t endpoint;
+  uint16_t cluster_id;
+  uint8_t command_id;
+  uint8_t result;
+  int32_t exit_status;
+} control_action_event_t;
+
+typedef struct {
+  uint8_t index;
+  uint16_t node_id;
+  uint8_t lqi;
+  uint8_t in_cost;
+  uint8_t out_cost;
+  uint8_t age;
+} control_neighbor_event_t;
+
+typedef struct {
+  uint32_t captured;
+  uint32_t dropped;
+  uint32_t truncated;
+  uint32_t bytes_written;
+  uint32_t rotations;
+} control_capture_stats_event_t;
+
+/*
+ * Writes the header for a message with `length` bytes of value, which
+ * the caller writes right after it. Returns where the value goes.
+ */
+uint8_t* control_put_header(uint8_t *out, uint8_t type, uint16_t length) {
+  *out++ = type;
+  return put_le16(out, length);
+}
+
+/*
+ * Encodes a message with an opaque value into `out`, which must have
+ * `CONTROL_HEADER_SIZE + length` bytes available. Returns the frame size.
+ */
+size_t control_encode(uint8_t *out, uint8_t type, const void *value,
+                      uint16_t length) {
+  uint8_t *value_out = control_put_header(out, type, length);
+  if (length > 0) {
+    memcpy(value_out, value, length);
+  }
+  return CONTROL_HEADER_SIZE + length;
+}
+
+size_t control_encode_state_event(uint8_t *out,
+                                  const control_state_event_t *event) {
+  out = control_put_header(out, CONTROL_MSG_STATE, CONTROL_STATE_EVENT_SIZE);
+  out[0] = event->prev_state;
+  out[1] = event->new_state;
+  return CONTROL_HEADER_SIZE + CONTROL_STATE_EVENT_SIZE;
+}
+
+size_t control_encode_action_event(uint8_t *out,
+                                   const control_action_event_t *event) {
+  out = control_put_header(out, CONTROL_MSG_ACTION, CONTROL_ACTION_EVENT_SIZE);
+  *out++ = event->endpoint;
+  out = put_le16(out, event->cluster_id);
+  *out++ = event->command_id;
+  *out++ = event->result;
+  put_le32(out, (uint32_t)event->exit_status);
+  return CONTROL_HEADER_SIZE + CONTROL_ACTION_EVENT_SIZE;
+}
+
+size_t control_encode_neighbor_event(uint8_t *out,
+                                     const control_neighbor_event_t *event) {
+  out = control_put_header(out, CONTROL_MSG_NEIGHBOR,
+                           CONTROL_NEIGHBOR_EVENT_SIZE);
+  *out++ = event->index;
+  out = put_le16(out, event->node_id);
+  *out++ = event->lqi;
+  *out++ = event->in_cost;
+  *out++ = event->out_cost;
+  *out++ = event->age;
+  return CONTROL_HEADER_SIZE + CONTROL_NEIGHBOR_EVENT_SIZE;
+}
+
+size_t control_encode_capture_stats_event(
+    uint8_t *out, const control_capture_stats_event_t *event) {
+  out = control_put_header(out, CONTROL_MSG_CAPTURE_STATS,
+                           CONTROL_CAPTURE_STATS_EVENT_SIZE);
+  out = put_le32(out, event->captured);
+  out = put_le32(out, event->dropped);
+  out = put_le32(out, event->truncated);
+  out = put_le32(out, event->bytes_written);
+  put_le32(out, event->rotations);
+  return CONTROL_HEADER_SIZE + CONTROL_CAPTURE_STATS_EVENT_SIZE;
+}
+
+// Decoders return false if the message isn't of the expected type or size
+
+bool control_decode_state_event(const control_message_t *message,
+                                control_state_event_t *event) {
+  if (message->type != CONTROL_MSG_STATE ||
+      message->length != CONTROL_STATE_EVENT_SIZE) {
+    return false;
+  }
+  event->prev_state = message->value[0];
+  event->new_state = message->value[1];
+  return true;
+}
+
+bool control_decode_action_event(const control_message_t *message,
+                                 control_action_event_t *event) {
+  if (message->type != CONTROL_MSG_ACTION ||
+      message->length != CONTROL_ACTION_EVENT_SIZE) {
+    return false;
+  }
+  const uint8_t *in = message->value;
+  event->endpoint = *in++;
+  in = get_le16(in, &event->cluster_id);
+  event->command_id = *in++;
+  event->result = *in++;
+  uint32_t exit_status;
+  get_le32(in, &exit_status);
+  event->exit_status = (int32_t)exit_status;
+  return true;
+}
+
+bool control_decode_neighbor_event(const control_message_t *message,
+                                   control_neighbor_event_t *event) {
+  if (message->type != CONTROL_MSG_NEIGHBOR ||
+      message->length != CONTROL_NEIGHBOR_EVENT_SIZE) {
+    return false;
+  }
+  const uint8_t *in = message->value;
+  event->index = *in++;
+  in = get_le16(in, &event->node_id);
+  event->lqi = *in++;
+  event->in_cost = *in++;
+  event->out_cost = *in++;
+  event->age = *in;
+  return true;
+}
+
+bool control_decode_capture_stats_event(
+    const control_message_t *message, control_capture_stats_event_t *event) {
+  if (message->type != CONTROL_MSG_CAPTURE_STATS ||
+      message->length != CONTROL_CAPTURE_STATS_EVENT_SIZE) {
+    return false;
+  }
+  const uint8_t *in = message->value;
+  in = get_le32(in, &event->captured);
+  in = get_le32(in, &event->dropped);
+  in = get_le32(in, &event->truncated);
+  in = get_le32(in, &event->bytes_written);
+  get_le32(in, &event->rotations);
+  return true;
+}
+
+typedef enum {
+  CONTROL_PARSE_MESSAGE,
+  CONTROL_PARSE_NEED_MORE,
+  CONTROL_PARSE_TOO_LONG
+} CONTROL_PARSE_RESULT;
+
+/*
+ * Splits a byte stream into messages, using a buffer that fits the
+ * largest frame. Read into `control_parser_space`, report the bytes read
+ * with `control_parser_fill` and then take messages out with
+ * `control_parser_next` until it needs more.
+ */
+typedef struct {
+  uint8_t buffer[CONTROL_FRAME_MAX_SIZE];
+  size_t length;
+  size_t consumed;
+  // What's left to drop of a message that was too long
+  size_t skipping;
+} control_parser_t;
+
+void control_parser_init(control_parser_t *parser) {
+  parser->length = parser->consumed = parser->skipping = 0;
+}
+
+/*
+ * Makes room by dropping messages already returned, which invalidates
+ * their values. Returns where to read into, and how much in `available`.
+ */
+uint8_t* control_parser_space(control_parser_t *parser, size_t *available) {
+  if (parser->consumed > 0) {
+    memmove(parser->buffer, parser->buffer + parser->consumed,
+            parser->length - parser->consumed);
+    parser->length -= parser->consumed;
+    parser->consumed = 0;
+  }
+  *available = sizeof(parser->buffer) - parser->length;
+  return parser->buffer + parser->length;
+}
+
+void control_parser_fill(control_parser_t *parser, size_t length) {
+  parser->length += length;
+}
+
+/*
+ * Messages too long for the buffer are reported once with
+ * `CONTROL_PARSE_TOO_LONG` and then dropped as they come in, parsing
+ * carries on with the message after them.
+ */
+CONTROL_PARSE_RESULT control_parser_next(control_parser_t *parser,
+                                         control_message_t *message) {
+  size_t pending = parser->length - parser->consumed;
+  size_t skipped = pending < parser->skipping ? pending : parser->skipping;
+  parser->consumed += skipped;
+  parser->skipping -= skipped;
+  pending -= skipped;
+  const uint8_t *start = parser->buffer + parser->consumed;
+  if (pending < CONTROL_HEADER_SIZE) {
+    return CONTROL_PARSE_NEED_MORE;
+  }
+  uint16_t length;
+  get_le16(start + 1, &length);
+  if (length > CONTROL_MAX_VALUE_LENGTH) {
+    parser->skipping = CONTROL_HEADER_SIZE + length;
+    return CONTROL_PARSE_TOO_LONG;
+  }
+  if (pending < CONTROL_HEADER_SIZE + (size_t)length) {
+    return CONTROL_PARSE_NEED_MORE;
+  }
+  message->type = start[0];
+  message->length = length;
+  message->value = start + CONTROL_HEADER_SIZE;
+  parser->consumed += CONTROL_HEADER_SIZE + length;
+  return CONTROL_PARSE_MESSAGE;
+}
+
+/*
+ * Points `data` to the bytes not parsed yet, for when the stream stops
+ * being framed. Returns how many there are.
+ */
+size_t control_parser_pending(const control_parser_t *parser,
+                              const uint8_t **data) {
+  size_t pending = parser->length - parser->consumed;
+  size_t skipped = pending < parser->skipping ? pending : parser->skipping;
+  *data = parser->buffer + parser->consumed + skipped;
+  return pending - skipped;
+}
+
+#endif /* CONTROL_PROTOCOL_H */
@@ -0,0 +1,79 @@
+#ifndef EZSP_DEFERRED_H
+#define EZSP_DEFERRED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define EZSP_DEFERRED_SIZE 32
+
+typedef struct ezsp_deferred_request {
+  // Issues the EZSP call and handles its result
+  void (*execute)(const struct ezsp_deferred_request *request);
+  void *context;
+  uint32_t argument;
+} ezsp_deferred_request_t;
+
+/*
+ * Bounded FIFO of EZSP calls put off to a later pass of the super loop.
+ * They're the same synchronous calls, run a few per pass, so that a long
+ * sequence of them like a table walk doesn't keep the stack from
+ * processing callbacks until it's done.
+ */
+typedef struct {
+  ezsp_deferred_request_t requests[EZSP_DEFERRED_SIZE];
+  uint32_t head;
+  uint32_t tail;
+  uint32_t completed;
+  uint32_t rejected;
+} ezsp_deferred_t;
+
+void ezsp_deferred_init(ezsp_deferred_t *deferred) {
+  deferred->head = deferred->tail = 0;
+  deferred->completed = deferred->rejected = 0;
+}
+
+size_t ezsp_deferred_pending(const ezsp_deferred_t *deferred) {
+  return deferred->head - deferred->tail;
+}
+
+/*
+ * Defers a call to `execute`, returns false if there are already
+ * EZSP_DEFERRED_SIZE calls pending, in which case it's never run.
+ */
+bool ezsp_deferred_submit(ezsp_deferred_t *deferred,
+                          void (*execute)(const ezsp_deferred_request_t *request),
+                          void *context, uint32_t argument) {
+  if (ezsp_deferred_pending(deferred) >= EZSP_DEFERRED_SIZE) {
+    deferred->rejected++;
+    return false;
+  }
+  ezsp_deferred_request_t *request =
+    &deferred->requests[deferred->head % EZSP_DEFERRED_SIZE];
+  request->execute = execute;
+  request->context = context;
+  request->argument = argument;
+  deferred->head++;
+  return true;
+}
+
+/*
+ * Runs up to `max_requests` deferred calls in order. Calls deferred while
+ * running wait for the next pass. Returns the number of calls that ran.
+ */
+size_t ezsp_deferred_run(ezsp_deferred_t *deferred, size_t max_requests) {
+  uint32_t end = deferred->head;
+  size_t processed = 0;
+  while (deferred->tail != end && processed < max_requests) {
+    // Copied out since `execute` may reuse the slot
+    ezsp_deferred_request_t request =
+      deferred->requests[deferred->tail % EZSP_DEFERRED_SIZE];
+    deferred->tail++;
+    request.execute(&request);
+    deferred->completed++;
+    processed++;
+  }
+  return processed;
+}
+
+#endif /* EZSP_DEFERRED_H */
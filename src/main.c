@@ -34,7 +34,16 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <time.h>
 #include "commands.h"
+#include "actions.h"
+#include "ota_images.h"
+#include "capture.h"
+#include "snapshot.h"
+#include "ezsp_deferred.h"
+#include "control_protocol.h"
 
 #define INVALID_FD -1
 #define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
@@ -45,6 +54,28 @@
   assert(false); \
 }
 
+#define OTA_SERVER_BLOCKS_PER_SECOND 10
+#define OTA_SERVER_BLOCK_BURST 5
+// ZCL header plus the fixed fields of an image block response
+#define OTA_IMAGE_BLOCK_RESPONSE_OVERHEAD 17
+#define OTA_RESPONSE_FRAME_CONTROL \
+  (ZCL_CLUSTER_SPECIFIC_COMMAND \
+    | ZCL_FRAME_CONTROL_SERVER_TO_CLIENT \
+    | ZCL_DISABLE_DEFAULT_RESPONSE_MASK)
+
+// Added to the frame counters of a snapshot when restoring it, to stay ahead
+// of what the old NCP might have sent after the snapshot was taken
+#define RESTORE_FRAME_COUNTER_MARGIN 0x1000
+// Sequence, node id, EUI64 and capabilities
+#define ZDO_DEVICE_ANNOUNCE_SIZE 12
+// Full function device, mains powered, receiver on when idle, allocates
+// addresses
+#define ZDO_DEVICE_ANNOUNCE_ROUTER_CAPABILITIES 0x8E
+
+// Deferred EZSP calls run per super loop iteration, so that the stack
+// gets to process callbacks in between
+#define EZSP_DEFERRED_BATCH 4
+
 #define logInfoWith(func, args...) func("INFO: " args)
 
 #define logInfoln(args...) logInfoWith(emberAfAppPrintln, args)
@@ -93,6 +124,33 @@ const char* decode_app_state_short(APP_STATE state) {
   assert(0);
 }
 
+CONTROL_STATE app_state_to_control(APP_STATE state) {
+  switch (state) {
+    case APP_STATE_UNKNOWN: return CONTROL_STATE_UNKNOWN;
+    case APP_STATE_DISCONNECTED: return CONTROL_STATE_DISCONNECTED;
+    case APP_STATE_RECONNECTING: return CONTROL_STATE_RECONNECTING;
+    case APP_STATE_NO_NETWORK: return CONTROL_STATE_NO_NETWORK;
+    case APP_STATE_SCANNING: return CONTROL_STATE_SCANNING;
+    case APP_STATE_SCANNED: return CONTROL_STATE_SCANNED;
+    case APP_STATE_JOINING: return CONTROL_STATE_JOINING;
+    case APP_STATE_CONNECTED: return CONTROL_STATE_CONNECTED;
+    case APP_STATE_HALTED: return CONTROL_STATE_HALTED;
+  }
+  assert(0);
+}
+
+CONTROL_ACTION_RESULT action_result_to_control(ACTION_RESULT result) {
+  switch (result) {
+    case ACTION_RESULT_STARTED: return CONTROL_ACTION_RESULT_STARTED;
+    case ACTION_RESULT_SUCCESS: return CONTROL_ACTION_RESULT_SUCCESS;
+    case ACTION_RESULT_FAILED: return CONTROL_ACTION_RESULT_FAILED;
+    case ACTION_RESULT_TIMEOUT: return CONTROL_ACTION_RESULT_TIMEOUT;
+    case ACTION_RESULT_BUSY: return CONTROL_ACTION_RESULT_BUSY;
+    case ACTION_RESULT_SPAWN_FAILED: return CONTROL_ACTION_RESULT_SPAWN_FAILED;
+  }
+  assert(0);
+}
+
 EmberZigbeeNetwork best_network = {};
 int8_t best_rssi;
 int networks_found = 0;
@@ -100,14 +158,68 @@ int join_attempts = 0;
 
 FILE* input_fifo_file = NULL;
 FILE* output_fifo_file = NULL;
+// Set after a client negotiates the binary control protocol, until it
+// switches back or closes the input fifo
+bool binary_mode = false;
+// Text commands read from the input fifo, see `read_command`
+static char commands_buffer[COMMAND_MAX_LENGTH+1];
+static char command_buffer[COMMAND_MAX_LENGTH+1];
 
 const int max_join_attempts = 5;
 const char input_fifo_name[] = "ezsp_router.in";
 const char output_fifo_name[] = "ezsp_router.out";
 const char pid_file_name[] = "ezsp_router.pid";
+const char actions_file_name[] = "ezsp_router.actions";
+const char ota_images_dir_name[] = "ezsp_router.ota";
+const char snapshot_file_name[] = "ezsp_router.snapshot";
+// Holds the restore start time and snapshot path while the NCP restarts
+// with its restored EUI64
+const char restore_file_name[] = "ezsp_router.restore";
+
+action_executor_t action_executor;
+ota_images_t ota_images;
+ota_rate_limiter_t ota_rate_limiter;
+capture_t capture;
+network_snapshot_t pending_restore;
+char pending_restore_path[COMMAND_MAX_LENGTH+1];
+bool restore_pending = false;
+// Set by `restore --write-eui64`, the token can only be written once
+bool restore_write_eui64 = false;
+bool restoring = false;
+// Wall clock, to time restores that span a restart
+uint64_t restore_started_ms;
+uint8_t restore_announce_sequence;
+ezsp_deferred_t ezsp_deferred;
+
+// What's needed to answer a ZCL command after we've returned from
+// the callback that received it
+typedef struct {
+  EmberNodeId source;
+  uint8_t source_endpoint;
+  uint8_t destination_endpoint;
+  uint16_t cluster_id;
+  uint8_t command_id;
+  uint8_t sequence;
+  bool disable_default_response;
+} zcl_reply_t;
+
+static void write_frame(const uint8_t* frame, size_t size) {
+  assert(output_fifo_file != NULL);
+  fwrite(frame, 1, size, output_fifo_file);
+  fflush(output_fifo_file);
+}
 
 static void on_state_changed(APP_STATE prev_state, APP_STATE new_state) {
   assert(output_fifo_file != NULL);
+  if (binary_mode) {
+    uint8_t frame[CONTROL_HEADER_SIZE + CONTROL_STATE_EVENT_SIZE];
+    control_state_event_t event = {
+      app_state_to_control(prev_state),
+      app_state_to_control(new_state)
+    };
+    write_frame(frame, control_encode_state_event(frame, &event));
+    return;
+  }
   fprintf(
     output_fifo_file,
     "state %s %s\n",
@@ -117,6 +229,133 @@ static void on_state_changed(APP_STATE prev_state, APP_STATE new_state) {
   fflush(output_fifo_file);
 }
 
+// In binary mode the line is sent as a text event, without the newline
+static void print_event(const char* format, ...) {
+  assert(output_fifo_file != NULL);
+  va_list args;
+  va_start(args, format);
+  if (binary_mode) {
+    uint8_t frame[CONTROL_FRAME_MAX_SIZE];
+    char* text = (char*)frame + CONTROL_HEADER_SIZE;
+    int length = vsnprintf(text, CONTROL_MAX_VALUE_LENGTH + 1, format, args);
+    va_end(args);
+    if (length < 0) {
+      return;
+    }
+    length = MIN(length, CONTROL_MAX_VALUE_LENGTH);
+    if (length > 0 && text[length - 1] == '\n') {
+      length--;
+    }
+    control_put_header(frame, CONTROL_MSG_TEXT_EVENT, length);
+    write_frame(frame, CONTROL_HEADER_SIZE + length);
+    return;
+  }
+  vfprintf(output_fifo_file, format, args);
+  va_end(args);
+  fflush(output_fifo_file);
+}
+
+APP_STATE advance_state(APP_STATE next_state);
+void resume_restore();
+
+uint64_t wall_clock_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Halts instead of scanning for a network, which would have the stick join
+// as a new device and then refuse to be restored
+static void fail_restore(const char* error) {
+  restoring = false;
+  logInfoln("Failed to restore from snapshot, halting until restored again or restarted");
+  print_event("restore error %s\n", error);
+  advance_state(APP_STATE_HALTED);
+}
+
+/*
+ * EZSP has no way to pick the node id the restored network comes up
+ * with, so the stick most likely got a new one. A device announce has
+ * the coordinator and neighbors update the address they have for the
+ * EUI64, as they do after an end device rejoins.
+ */
+static void announce_restored_node_id() {
+  EmberNodeId node_id = ezspGetNodeId();
+  if (node_id == pending_restore.node_id) {
+    return;
+  }
+  logInfoln("Restored with node id 0x%04X instead of 0x%04X, announcing it",
+            node_id, pending_restore.node_id);
+  uint8_t message[ZDO_DEVICE_ANNOUNCE_SIZE];
+  uint8_t* out = message;
+  *out++ = restore_announce_sequence++;
+  out = put_le16(out, node_id);
+  memcpy(out, pending_restore.eui64, EUI64_SIZE);
+  out += EUI64_SIZE;
+  *out = ZDO_DEVICE_ANNOUNCE_ROUTER_CAPABILITIES;
+  EmberApsFrame aps_frame = {};
+  aps_frame.profileId = EMBER_ZDO_PROFILE_ID;
+  aps_frame.clusterId = END_DEVICE_ANNOUNCE;
+  aps_frame.options = EMBER_APS_OPTION_NONE;
+  uint8_t sequence;
+  EmberStatus status = ezspSendBroadcast(
+    EMBER_RX_ON_WHEN_IDLE_BROADCAST_ADDRESS,
+    &aps_frame,
+    EMBER_MAX_HOPS,
+    0,
+    sizeof(message),
+    message,
+    &sequence
+  );
+  if (status != EMBER_SUCCESS) {
+    emberAfAppPrintln("WARNING: Failed to announce restored node id: 0x%02X", status);
+  }
+}
+
+static void on_restore_state_changed(APP_STATE new_state) {
+  if (!restoring) {
+    return;
+  }
+  if (new_state == APP_STATE_CONNECTED) {
+    restoring = false;
+    announce_restored_node_id();
+    uint64_t elapsed_ms = wall_clock_ms() - restore_started_ms;
+    logInfoln("Restored network from snapshot in %llu ms", (unsigned long long)elapsed_ms);
+    print_event("restore ok %llu\n", (unsigned long long)elapsed_ms);
+    return;
+  }
+  if (new_state != APP_STATE_JOINING) {
+    logInfoln("Failed to bring up network from snapshot");
+    fail_restore("join_failed");
+  }
+}
+
+static void on_action_event(const action_t* action, ACTION_RESULT result, int exit_status) {
+  assert(output_fifo_file != NULL);
+  if (binary_mode) {
+    uint8_t frame[CONTROL_HEADER_SIZE + CONTROL_ACTION_EVENT_SIZE];
+    control_action_event_t event = {
+      action->endpoint,
+      action->cluster_id,
+      action->command_id,
+      action_result_to_control(result),
+      exit_status
+    };
+    write_frame(frame, control_encode_action_event(frame, &event));
+    return;
+  }
+  fprintf(
+    output_fifo_file,
+    "action %u 0x%04X 0x%02X %s %d\n",
+    action->endpoint,
+    action->cluster_id,
+    action->command_id,
+    decode_action_result_short(result),
+    exit_status
+  );
+  fflush(output_fifo_file);
+}
+
 void remove_fifos() {
   fclose(input_fifo_file);
   fclose(output_fifo_file);
@@ -168,6 +407,7 @@ void init_fifos() {
 
 static void on_exit() {
   logInfoln("Doing cleanup");
+  capture_stop(&capture);
   remove_fifos();
   remove(pid_file_name);
 }
@@ -182,6 +422,53 @@ bool create_pid_file(const char* file_name) {
   return true;
 }
 
+void init_actions() {
+  assertAppCase(
+    sizeof(zcl_reply_t) <= ACTION_CONTEXT_SIZE,
+    "ZCL reply doesn't fit in action context"
+  );
+  if (!actions_init(&action_executor)) {
+    assertAppCase(false, "Failed to set up action executor: %s", strerror(errno));
+  }
+  FILE* actions_file = fopen(actions_file_name, "r");
+  if (!actions_file) {
+    logInfoln("No actions file found, ZCL actions disabled");
+    return;
+  }
+  int bad_line = 0;
+  bool loaded = actions_load(&action_executor, actions_file, &bad_line);
+  fclose(actions_file);
+  assertAppCase(loaded, "Failed to load actions file, error on line %d", bad_line);
+  logInfoln("Loaded %d actions", (int)action_executor.actions_count);
+}
+
+void init_ota_server() {
+  size_t skipped = 0;
+  if (!ota_images_load(&ota_images, ota_images_dir_name, &skipped)) {
+    logInfoln("No OTA images directory found, OTA server disabled");
+    return;
+  }
+  if (skipped > 0) {
+    emberAfAppPrintln("WARNING: Skipped %d invalid or excess OTA images", (int)skipped);
+  }
+  for (size_t i = 0; i < ota_images.count; i++) {
+    const ota_image_t* image = &ota_images.images[i];
+    logInfoln(
+      "Serving OTA image %s: manufacturer 0x%04X, type 0x%04X, version 0x%08X",
+      image->file_name,
+      image->manufacturer_code,
+      image->image_type,
+      image->file_version
+    );
+  }
+  ota_rate_limiter_init(
+    &ota_rate_limiter,
+    OTA_SERVER_BLOCKS_PER_SECOND,
+    OTA_SERVER_BLOCK_BURST,
+    halCommonGetInt32uMillisecondTick()
+  );
+}
+
 void app_init(void)
 {
   logInfoln("Creating pid file");
@@ -190,6 +477,16 @@ void app_init(void)
   }
   logInfoln("Creating control fifos");
   init_fifos();
+  logInfoln("Setting up host actions");
+  init_actions();
+  logInfoln("Indexing OTA images");
+  init_ota_server();
+  capture_init(&capture);
+  ezsp_deferred_init(&ezsp_deferred);
+  resume_restore();
+  // Writes to a capture fifo whose reader went away should fail with
+  // EPIPE instead of killing us
+  signal(SIGPIPE, SIG_IGN);
   logInfoln("Registering exit function");
   atexit(on_exit);
 }
@@ -201,6 +498,7 @@ APP_STATE advance_state(APP_STATE next_state) {
   }
   on_state_changed(prev_state, next_state);
   app_state = next_state;
+  on_restore_state_changed(next_state);
   return prev_state;
 }
 
@@ -223,6 +521,423 @@ static const EmberKeyData defaultLinkKey = {
     0x6C, 0x69, 0x61, 0x6E, 0x63, 0x65, 0x30, 0x39 }
 };
 
+void print_capture_stats() {
+  if (binary_mode) {
+    uint8_t frame[CONTROL_HEADER_SIZE + CONTROL_CAPTURE_STATS_EVENT_SIZE];
+    control_capture_stats_event_t event = {
+      capture.stats.captured,
+      capture.stats.dropped,
+      capture.stats.truncated,
+      capture.stats.bytes_written,
+      capture.stats.rotations
+    };
+    write_frame(frame, control_encode_capture_stats_event(frame, &event));
+    return;
+  }
+  print_event(
+    "capture stats %lu %lu %lu %lu %lu\n",
+    (unsigned long)capture.stats.captured,
+    (unsigned long)capture.stats.dropped,
+    (unsigned long)capture.stats.truncated,
+    (unsigned long)capture.stats.bytes_written,
+    (unsigned long)capture.stats.rotations
+  );
+}
+
+bool process_capture_command(const char* args) {
+  char action[COMMAND_MAX_LENGTH+1];
+  char path[COMMAND_MAX_LENGTH+1];
+  int matched = sscanf(args, "%s %s", action, path);
+  if (matched >= 1 && strcmp(action, "stats") == 0) {
+    print_capture_stats();
+    return true;
+  }
+  if (matched >= 1 && strcmp(action, "stop") == 0) {
+    logInfoln("Stopping capture");
+    capture_stop(&capture);
+    print_event("capture stopped\n");
+    print_capture_stats();
+    return true;
+  }
+  if (matched == 2 && strcmp(action, "start") == 0) {
+    EmberNodeType node_type;
+    EmberNetworkParameters params = {};
+    (void) ezspGetNetworkParameters(&node_type, &params);
+    if (!capture_start(
+      &capture,
+      path,
+      params.panId,
+      ezspGetNodeId(),
+      halCommonGetInt32uMillisecondTick())
+    ) {
+      logInfoln("Failed to start capture: %s", strerror(errno));
+      print_event("capture error %s\n", strerror(errno));
+      return false;
+    }
+    logInfoln("Capturing incoming messages to %s", path);
+    print_event("capture started %s\n", path);
+    return true;
+  }
+  logInfoln("Usage: capture start <path> | capture stop | capture stats");
+  return false;
+}
+
+void poll_capture() {
+  if (!capture_poll(&capture, halCommonGetInt32uMillisecondTick())) {
+    logInfoln("Capture stopped: %s", strerror(errno));
+    print_event("capture error %s\n", strerror(errno));
+    print_capture_stats();
+  }
+}
+
+bool take_snapshot(const char* path) {
+  if (!in_state(APP_STATE_CONNECTED)) {
+    print_event("snapshot error not_connected\n");
+    return false;
+  }
+  EmberNodeType node_type;
+  EmberNetworkParameters params;
+  EmberKeyStruct network_key;
+  EmberKeyStruct trust_center_key;
+  if (ezspGetNetworkParameters(&node_type, &params) != EMBER_SUCCESS
+      || ezspGetKey(EMBER_CURRENT_NETWORK_KEY, &network_key) != EMBER_SUCCESS
+      || ezspGetKey(EMBER_TRUST_CENTER_LINK_KEY, &trust_center_key) != EMBER_SUCCESS) {
+    logInfoln("Failed to read network parameters or keys from NCP");
+    print_event("snapshot error ezsp\n");
+    return false;
+  }
+  network_snapshot_t snapshot = {};
+  ezspGetEui64(snapshot.eui64);
+  snapshot.node_id = ezspGetNodeId();
+  (void) memcpy(snapshot.extended_pan_id, params.extendedPanId, sizeof(snapshot.extended_pan_id));
+  snapshot.pan_id = params.panId;
+  snapshot.radio_tx_power = params.radioTxPower;
+  snapshot.radio_channel = params.radioChannel;
+  snapshot.nwk_update_id = params.nwkUpdateId;
+  snapshot.nwk_manager_id = params.nwkManagerId;
+  snapshot.channels = params.channels;
+  (void) memcpy(
+    snapshot.network_key,
+    emberKeyContents(&network_key.key),
+    EMBER_ENCRYPTION_KEY_SIZE);
+  snapshot.network_key_sequence = network_key.sequenceNumber;
+  snapshot.network_frame_counter = network_key.outgoingFrameCounter;
+  if (trust_center_key.bitmask & EMBER_KEY_HAS_PARTNER_EUI64) {
+    (void) memcpy(
+      snapshot.trust_center_eui64,
+      trust_center_key.partnerEUI64,
+      sizeof(snapshot.trust_center_eui64));
+  }
+  (void) memcpy(
+    snapshot.trust_center_link_key,
+    emberKeyContents(&trust_center_key.key),
+    EMBER_ENCRYPTION_KEY_SIZE);
+  snapshot.aps_frame_counter = trust_center_key.outgoingFrameCounter;
+
+  SNAPSHOT_RESULT result = snapshot_write_file(path, &snapshot);
+  if (result != SNAPSHOT_RESULT_OK) {
+    logInfoln("Failed to write snapshot to %s: %s", path, strerror(errno));
+    print_event("snapshot error %s\n", decode_snapshot_result_short(result));
+    return false;
+  }
+  logInfoln("Saved network snapshot to %s", path);
+  print_event("snapshot ok %s\n", path);
+  return true;
+}
+
+bool request_restore(const char* path, bool write_eui64, uint64_t started_ms) {
+  if (restore_pending || restoring) {
+    print_event("restore error busy\n");
+    return false;
+  }
+  SNAPSHOT_RESULT result = snapshot_read_file(path, &pending_restore);
+  if (result != SNAPSHOT_RESULT_OK) {
+    logInfoln("Failed to read snapshot from %s", path);
+    print_event("restore error %s\n", decode_snapshot_result_short(result));
+    return false;
+  }
+  assert(strlen(path) < sizeof(pending_restore_path));
+  strcpy(pending_restore_path, path);
+  restore_write_eui64 = write_eui64;
+  // Timed from the restore command to get the whole failover time,
+  // including waiting for an ongoing scan to finish and restarting
+  restore_started_ms = started_ms;
+  restore_pending = true;
+  print_event("restore pending\n");
+  return true;
+}
+
+// restore [--write-eui64] [path]
+bool process_restore_command(const char* args) {
+  char first[COMMAND_MAX_LENGTH+1];
+  char path[COMMAND_MAX_LENGTH+1];
+  int matched = sscanf(args, "%s %s", first, path);
+  bool write_eui64 = matched >= 1 && strcmp(first, "--write-eui64") == 0;
+  if (matched < 1 || (write_eui64 && matched < 2)) {
+    strcpy(path, snapshot_file_name);
+  } else if (!write_eui64) {
+    if (matched == 2) {
+      logInfoln("Usage: restore [--write-eui64] [path]");
+      return false;
+    }
+    strcpy(path, first);
+  }
+  return request_restore(path, write_eui64, wall_clock_ms());
+}
+
+bool is_blank_token(const uint8_t* token, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    if (token[i] != 0xFF) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void save_restore_file() {
+  FILE* restore_file = fopen(restore_file_name, "w");
+  if (!restore_file
+      || fprintf(restore_file, "%llu %s\n",
+                 (unsigned long long)restore_started_ms, pending_restore_path) < 0) {
+    emberAfAppPrintln("WARNING: Failed to save restore path, run restore again after restarting");
+  }
+  if (restore_file) {
+    fclose(restore_file);
+  }
+}
+
+/*
+ * The EUI64 of a fresh NCP can be overridden once through the custom EUI64
+ * manufacturing token, which takes effect after the NCP resets. Writing it
+ * can't be undone, so it's only done when asked with --write-eui64.
+ */
+void restore_eui64(const network_snapshot_t* snapshot) {
+  uint8_t token[255];
+  uint8_t token_length = ezspGetMfgToken(EZSP_MFG_CUSTOM_EUI_64, token);
+  if (token_length < EUI64_SIZE) {
+    fail_restore("eui64_token");
+    return;
+  }
+  if (memcmp(token, snapshot->eui64, EUI64_SIZE) == 0) {
+    // Written already, the NCP just hasn't been reset since
+    logInfoln("NCP has the EUI64 from the snapshot written, restart to finish restoring");
+  } else if (!is_blank_token(token, EUI64_SIZE)) {
+    logInfoln("NCP has a different custom EUI64 already written");
+    fail_restore("eui64_mismatch");
+    return;
+  } else if (!restore_write_eui64) {
+    logInfoln("Restoring needs the EUI64 written to the NCP, which can only be done "
+              "once, run restore --write-eui64 to do it");
+    fail_restore("eui64_write_required");
+    return;
+  } else {
+    EmberStatus status = ezspSetMfgToken(
+      EZSP_MFG_CUSTOM_EUI_64,
+      EUI64_SIZE,
+      (uint8_t*)snapshot->eui64
+    );
+    if (status != EMBER_SUCCESS) {
+      fail_restore("eui64_write");
+      return;
+    }
+    logInfoln("Wrote EUI64 from snapshot, restart to reset the NCP and finish restoring");
+  }
+  save_restore_file();
+  print_event("restore restart_required\n");
+  advance_state(APP_STATE_HALTED);
+}
+
+// Picks up a restore interrupted by the restart needed to apply the EUI64,
+// before the state machine gets to scan for networks
+void resume_restore() {
+  FILE* restore_file = fopen(restore_file_name, "r");
+  if (!restore_file) {
+    return;
+  }
+  unsigned long long started_ms;
+  char path[COMMAND_MAX_LENGTH+1];
+  bool have_path = fscanf(restore_file, "%llu ", &started_ms) == 1
+    && fgets(path, sizeof(path), restore_file) != NULL;
+  fclose(restore_file);
+  remove(restore_file_name);
+  if (!have_path) {
+    return;
+  }
+  path[strcspn(path, "\n")] = '\0';
+  logInfoln("Resuming restore from %s", path);
+  request_restore(path, false, started_ms);
+}
+
+bool set_restored_frame_counter(EzspValueId value_id, uint32_t frame_counter) {
+  uint32_t value = frame_counter + RESTORE_FRAME_COUNTER_MARGIN;
+  uint8_t bytes[4] = {
+    value & 0xFF,
+    (value >> 8) & 0xFF,
+    (value >> 16) & 0xFF,
+    (value >> 24) & 0xFF
+  };
+  return ezspSetValue(value_id, sizeof(bytes), bytes) == EZSP_SUCCESS;
+}
+
+/*
+ * Sets up a fresh NCP with the identity, keys and frame counters from
+ * the snapshot, then brings it up on the saved channel and PAN as an
+ * already commissioned router. Nothing is sent to join, so the network
+ * doesn't need to be permitting joins.
+ */
+void restore_network(const network_snapshot_t* snapshot) {
+  EmberEUI64 eui64;
+  ezspGetEui64(eui64);
+  if (memcmp(eui64, snapshot->eui64, EUI64_SIZE) != 0) {
+    restore_eui64(snapshot);
+    return;
+  }
+
+  EmberInitialSecurityState sec_state = {};
+  (void) memcpy(
+    emberKeyContents(&(sec_state.preconfiguredKey)),
+    snapshot->trust_center_link_key,
+    EMBER_ENCRYPTION_KEY_SIZE);
+  (void) memcpy(
+    emberKeyContents(&(sec_state.networkKey)),
+    snapshot->network_key,
+    EMBER_ENCRYPTION_KEY_SIZE);
+  sec_state.networkKeySequenceNumber = snapshot->network_key_sequence;
+  sec_state.bitmask = ( EMBER_HAVE_PRECONFIGURED_KEY
+                      | EMBER_HAVE_NETWORK_KEY
+                      | EMBER_REQUIRE_ENCRYPTED_KEY
+                      | EMBER_NO_FRAME_COUNTER_RESET);
+  if (memcmp(snapshot->trust_center_link_key,
+             emberKeyContents(&defaultLinkKey),
+             EMBER_ENCRYPTION_KEY_SIZE) == 0) {
+    sec_state.bitmask |= EMBER_TRUST_CENTER_GLOBAL_LINK_KEY;
+  }
+  uint8_t no_eui64[EUI64_SIZE] = {};
+  if (memcmp(snapshot->trust_center_eui64, no_eui64, EUI64_SIZE) != 0) {
+    (void) memcpy(
+      sec_state.preconfiguredTrustCenterEui64,
+      snapshot->trust_center_eui64,
+      EUI64_SIZE);
+    sec_state.bitmask |= EMBER_HAVE_TRUST_CENTER_EUI64;
+  }
+  logInfoln("Setting security state from snapshot");
+  if (ezspSetInitialSecurityState(&sec_state) != EMBER_SUCCESS) {
+    fail_restore("security_state");
+    return;
+  }
+  if (!set_restored_frame_counter(EZSP_VALUE_NWK_FRAME_COUNTER, snapshot->network_frame_counter)
+      || !set_restored_frame_counter(EZSP_VALUE_APS_FRAME_COUNTER, snapshot->aps_frame_counter)) {
+    fail_restore("frame_counters");
+    return;
+  }
+
+  EmberNetworkParameters params = {};
+  (void) memcpy(params.extendedPanId, snapshot->extended_pan_id, sizeof(params.extendedPanId));
+  params.panId = snapshot->pan_id;
+  params.radioTxPower = snapshot->radio_tx_power;
+  params.radioChannel = snapshot->radio_channel;
+  params.nwkUpdateId = snapshot->nwk_update_id;
+  params.nwkManagerId = snapshot->nwk_manager_id;
+  params.channels = snapshot->channels;
+  params.joinMethod = EMBER_USE_CONFIGURED_NWK_STATE;
+  logInfoln("Joining network from snapshot");
+  if (ezspJoinNetwork(EMBER_ROUTER, &params) != EMBER_SUCCESS) {
+    fail_restore("join");
+    return;
+  }
+  networks_found = 0;
+  restoring = true;
+  advance_state(APP_STATE_JOINING);
+}
+
+void poll_restore() {
+  if (!restore_pending) {
+    return;
+  }
+  if (in_state(APP_STATE_UNKNOWN) || in_state(APP_STATE_SCANNING)) {
+    return;
+  }
+  restore_pending = false;
+  if (!(in_state(APP_STATE_NO_NETWORK)
+        || in_state(APP_STATE_SCANNED)
+        || in_state(APP_STATE_HALTED))) {
+    logInfoln("Not restoring snapshot, NCP is already on a network");
+    print_event("restore error network_up\n");
+    return;
+  }
+  restore_network(&pending_restore);
+}
+
+static void execute_neighbor_count(const ezsp_deferred_request_t* request);
+static void execute_get_neighbor(const ezsp_deferred_request_t* request);
+
+bool ezsp_deferred_neighbor_count() {
+  return ezsp_deferred_submit(&ezsp_deferred, execute_neighbor_count, NULL, 0);
+}
+
+// The neighbor count is carried along to know when the walk is done
+bool ezsp_deferred_get_neighbor(uint8_t index, uint8_t count) {
+  return ezsp_deferred_submit(
+    &ezsp_deferred, execute_get_neighbor, (void*)(uintptr_t)count, index
+  );
+}
+
+/*
+ * Entries are read one after the other, so a walk only ever takes one
+ * slot of the deferred calls and ends with either `done` or `error`.
+ */
+void on_neighbor(EmberStatus status, uint8_t index, const EmberNeighborTableEntry* entry, uint8_t count) {
+  if (status == EMBER_SUCCESS && binary_mode) {
+    uint8_t frame[CONTROL_HEADER_SIZE + CONTROL_NEIGHBOR_EVENT_SIZE];
+    control_neighbor_event_t event = {
+      index,
+      entry->shortId,
+      entry->averageLqi,
+      entry->inCost,
+      entry->outCost,
+      entry->age
+    };
+    write_frame(frame, control_encode_neighbor_event(frame, &event));
+  } else if (status == EMBER_SUCCESS) {
+    print_event(
+      "neighbor %u 0x%04X %u %u %u %u\n",
+      index,
+      entry->shortId,
+      entry->averageLqi,
+      entry->inCost,
+      entry->outCost,
+      entry->age
+    );
+  }
+  if (index + 1 == count) {
+    print_event("neighbors done %u\n", count);
+    return;
+  }
+  if (!ezsp_deferred_get_neighbor(index + 1, count)) {
+    print_event("neighbors error queue_full\n");
+  }
+}
+
+void on_neighbor_count(uint8_t count) {
+  if (count == 0) {
+    print_event("neighbors done 0\n");
+    return;
+  }
+  if (!ezsp_deferred_get_neighbor(0, count)) {
+    print_event("neighbors error queue_full\n");
+  }
+}
+
+static void execute_neighbor_count(const ezsp_deferred_request_t* request) {
+  on_neighbor_count(ezspNeighborCount());
+}
+
+static void execute_get_neighbor(const ezsp_deferred_request_t* request) {
+  EmberNeighborTableEntry entry;
+  EmberStatus status = ezspGetNeighbor(request->argument, &entry);
+  on_neighbor(status, request->argument, &entry, (uintptr_t)request->context);
+}
+
 bool process_command(const char* command) {
   // TODO: join, leave
   // should we just use optarg?
@@ -238,13 +953,120 @@ bool process_command(const char* command) {
     logInfoln("Got exit command, code: %hhu", code);
     exit(code);
   }
+  if (strcmp(argument, "snapshot") == 0) {
+    char path[COMMAND_MAX_LENGTH+1];
+    if (sscanf(command + strlen(argument), "%s", path) < 1) {
+      strcpy(path, snapshot_file_name);
+    }
+    return take_snapshot(path);
+  }
+  if (strcmp(argument, "restore") == 0) {
+    return process_restore_command(command + strlen(argument));
+  }
+  if (strcmp(argument, "neighbors") == 0) {
+    if (!ezsp_deferred_neighbor_count()) {
+      print_event("neighbors error queue_full\n");
+      return false;
+    }
+    return true;
+  }
+  if (strcmp(argument, "capture") == 0) {
+    return process_capture_command(command + strlen(argument));
+  }
+  if (strcmp(argument, "binary") == 0) {
+    int version = 0;
+    sscanf(command + strlen(argument), "%i", &version);
+    if (binary_mode || version != CONTROL_PROTOCOL_VERSION) {
+      print_event("binary error version\n");
+      return false;
+    }
+    // Acknowledged in text, anything after this line is framed. Clients
+    // wait for it before sending frames, so text read past the request
+    // isn't theirs to keep.
+    print_event("binary ok %d\n", CONTROL_PROTOCOL_VERSION);
+    logInfoln("Switching to binary control protocol");
+    if (commands_buffer[0] != '\0') {
+      logInfoln("Dropping text read after the binary request: %s", commands_buffer);
+      commands_buffer[0] = '\0';
+    }
+    binary_mode = true;
+    return true;
+  }
   logInfoln("Unrecognized command: %s", command);
   return false;
 }
 
+static control_parser_t command_parser;
+
+/*
+ * Hands whatever came after the last message over to the text command
+ * reader, as the client may write text right after switching back.
+ */
+void leave_binary_mode() {
+  logInfoln("Switching to text control protocol");
+  binary_mode = false;
+  const uint8_t* pending;
+  size_t pending_length = control_parser_pending(&command_parser, &pending);
+  const uint8_t* nul = memchr(pending, '\0', pending_length);
+  if (nul) {
+    pending_length = nul - pending;
+  }
+  if (pending_length > COMMAND_MAX_LENGTH) {
+    logInfoln("Dropping text past the command buffer after switching to text");
+    pending_length = COMMAND_MAX_LENGTH;
+  }
+  assert(commands_buffer[0] == '\0');
+  memcpy(commands_buffer, pending, pending_length);
+  commands_buffer[pending_length] = '\0';
+  control_parser_init(&command_parser);
+}
+
+void poll_binary_commands() {
+  size_t available;
+  uint8_t* space = control_parser_space(&command_parser, &available);
+  ssize_t bytes_read = read(fileno(input_fifo_file), space, available);
+  if (bytes_read == 0) {
+    // Every writer closed the fifo, the next one starts in text mode and
+    // a partial message left behind is of no use to it
+    control_parser_init(&command_parser);
+    leave_binary_mode();
+    return;
+  }
+  if (bytes_read == -1) {
+    assertAppCase(
+      errno == EAGAIN || errno == EWOULDBLOCK,
+      "Failed to read from command input buffer: %s",
+      strerror(errno)
+    );
+    return;
+  }
+  control_parser_fill(&command_parser, bytes_read);
+
+  control_message_t message;
+  CONTROL_PARSE_RESULT result;
+  while (binary_mode
+         && (result = control_parser_next(&command_parser, &message)) != CONTROL_PARSE_NEED_MORE) {
+    if (result == CONTROL_PARSE_TOO_LONG) {
+      logInfoln("Dropping control message longer than %d bytes", CONTROL_MAX_VALUE_LENGTH);
+      print_event("binary error too_long\n");
+    } else if (message.type == CONTROL_MSG_TEXT_MODE) {
+      leave_binary_mode();
+    } else if (message.type == CONTROL_MSG_COMMAND) {
+      char command[CONTROL_MAX_VALUE_LENGTH+1];
+      memcpy(command, message.value, message.length);
+      command[message.length] = '\0';
+      process_command(command);
+    } else {
+      logInfoln("Ignoring control message of type 0x%02X", message.type);
+    }
+  }
+}
+
 void poll_commands() {
-  static char commands_buffer[COMMAND_MAX_LENGTH+1];
-  static char command_buffer[COMMAND_MAX_LENGTH+1];
+  if (binary_mode) {
+    poll_binary_commands();
+    return;
+  }
   bool have_command, buffer_full = false;
   assert(input_fifo_file);
   if (!read_command(
@@ -265,7 +1087,7 @@ void poll_commands() {
     "Command exceeded length of buffer (max is %d)", sizeof(command_buffer)-1
   );
   if (have_command) {
-    processs_command(command_buffer);
+    process_command(command_buffer);
     strcpy(command_buffer, "");
   }
 }
@@ -273,6 +1095,10 @@ void poll_commands() {
 void app_process_action(void)
 {
   poll_commands();
+  actions_poll(&action_executor);
+  poll_capture();
+  poll_restore();
+  ezsp_deferred_run(&ezsp_deferred, EZSP_DEFERRED_BATCH);
 
   if (in_state(APP_STATE_HALTED)) {
     return;
@@ -478,6 +1304,45 @@ void emberAfAppStackStatusCallback(EmberStatus status) {
   }
 }
 
+void emberAfAppIncomingMessageHandler(EmberIncomingMessageType type,
+                                      EmberApsFrame* apsFrame,
+                                      uint8_t lastHopLqi,
+                                      int8_t lastHopRssi,
+                                      EmberNodeId sender,
+                                      uint8_t bindingIndex,
+                                      uint8_t addressIndex,
+                                      uint8_t messageLength,
+                                      uint8_t* messageContents) {
+  capture_frame_t* frame = capture_reserve(&capture);
+  if (!frame) {
+    return;
+  }
+  switch (type) {
+    case EMBER_INCOMING_MULTICAST:
+    case EMBER_INCOMING_MULTICAST_LOOPBACK:
+      frame->delivery = CAPTURE_DELIVERY_GROUP;
+      break;
+    case EMBER_INCOMING_BROADCAST:
+    case EMBER_INCOMING_BROADCAST_LOOPBACK:
+      frame->delivery = CAPTURE_DELIVERY_BROADCAST;
+      break;
+    default:
+      frame->delivery = CAPTURE_DELIVERY_UNICAST;
+      break;
+  }
+  frame->sender = sender;
+  frame->rssi = lastHopRssi;
+  frame->lqi = lastHopLqi;
+  frame->profile_id = apsFrame->profileId;
+  frame->cluster_id = apsFrame->clusterId;
+  frame->group_id = apsFrame->groupId;
+  frame->source_endpoint = apsFrame->sourceEndpoint;
+  frame->destination_endpoint = apsFrame->destinationEndpoint;
+  frame->sequence = apsFrame->sequence;
+  capture_set_payload(&capture, frame, messageContents, messageLength);
+  capture_commit(&capture);
+}
+
 void emberAfAppScanCompleteHandler(uint8_t channel, EmberStatus status) {
   if (app_state != APP_STATE_SCANNING) {
     return;
@@ -489,6 +1354,264 @@ void emberAfAppScanCompleteHandler(uint8_t channel, EmberStatus status) {
   advance_state(APP_STATE_SCANNED);
 }
 
+void send_zcl_reply(const zcl_reply_t* reply) {
+  // The response buffer was filled with a new sequence number, but
+  // responses must carry the one from the request
+  appResponseData[1] = reply->sequence;
+  emberAfSetCommandEndpoints(reply->destination_endpoint, reply->source_endpoint);
+  EmberStatus status = emberAfSendCommandUnicast(EMBER_OUTGOING_DIRECT, reply->source);
+  if (status != EMBER_SUCCESS) {
+    emberAfAppPrintln("WARNING: Failed to send ZCL response, status 0x%02X", status);
+  }
+}
+
+void send_zcl_default_response(const zcl_reply_t* reply, EmberAfStatus status) {
+  if (reply->disable_default_response && status == EMBER_ZCL_STATUS_SUCCESS) {
+    return;
+  }
+  emberAfFillExternalBuffer(
+    ZCL_GLOBAL_COMMAND
+      | ZCL_FRAME_CONTROL_SERVER_TO_CLIENT
+      | ZCL_DISABLE_DEFAULT_RESPONSE_MASK,
+    reply->cluster_id,
+    ZCL_DEFAULT_RESPONSE_COMMAND_ID,
+    "uu",
+    reply->command_id,
+    status
+  );
+  send_zcl_reply(reply);
+}
+
+EmberAfStatus action_result_to_zcl_status(ACTION_RESULT result) {
+  switch (result) {
+    case ACTION_RESULT_SUCCESS: return EMBER_ZCL_STATUS_SUCCESS;
+    case ACTION_RESULT_TIMEOUT: return EMBER_ZCL_STATUS_TIMEOUT;
+    default: return EMBER_ZCL_STATUS_FAILURE;
+  }
+}
+
+void zcl_reply_for_command(const EmberAfClusterCommand* cmd, zcl_reply_t* reply) {
+  reply->source = cmd->source;
+  reply->source_endpoint = cmd->apsFrame->sourceEndpoint;
+  reply->destination_endpoint = cmd->apsFrame->destinationEndpoint;
+  reply->cluster_id = cmd->apsFrame->clusterId;
+  reply->command_id = cmd->commandId;
+  reply->sequence = cmd->seqNum;
+  reply->disable_default_response = cmd->buffer[0] & ZCL_DISABLE_DEFAULT_RESPONSE_MASK;
+}
+
+void handle_query_next_image(const zcl_reply_t* reply, const uint8_t* payload, uint16_t length) {
+  if (length < 9) {
+    send_zcl_default_response(reply, EMBER_ZCL_STATUS_MALFORMED_COMMAND);
+    return;
+  }
+  uint8_t field_control = emberAfGetInt8u(payload, 0, length);
+  uint16_t manufacturer_code = emberAfGetInt16u(payload, 1, length);
+  uint16_t image_type = emberAfGetInt16u(payload, 3, length);
+  uint32_t current_version = emberAfGetInt32u(payload, 5, length);
+  int hardware_version = (field_control & 0x01) && length >= 11
+    ? emberAfGetInt16u(payload, 9, length)
+    : -1;
+  const ota_image_t* image = ota_images_find_next(
+    &ota_images, manufacturer_code, image_type, current_version, hardware_version
+  );
+  if (!image) {
+    emberAfFillExternalBuffer(
+      OTA_RESPONSE_FRAME_CONTROL,
+      ZCL_OTA_BOOTLOAD_CLUSTER_ID,
+      ZCL_QUERY_NEXT_IMAGE_RESPONSE_COMMAND_ID,
+      "u",
+      EMBER_ZCL_STATUS_NO_IMAGE_AVAILABLE
+    );
+    send_zcl_reply(reply);
+    return;
+  }
+  logInfoln("Offering OTA image %s to node 0x%04X", image->file_name, reply->source);
+  emberAfFillExternalBuffer(
+    OTA_RESPONSE_FRAME_CONTROL,
+    ZCL_OTA_BOOTLOAD_CLUSTER_ID,
+    ZCL_QUERY_NEXT_IMAGE_RESPONSE_COMMAND_ID,
+    "uvvww",
+    EMBER_ZCL_STATUS_SUCCESS,
+    image->manufacturer_code,
+    image->image_type,
+    image->file_version,
+    image->image_size
+  );
+  send_zcl_reply(reply);
+}
+
+void handle_image_block(const EmberAfClusterCommand* cmd, const zcl_reply_t* reply,
+                        const uint8_t* payload, uint16_t length) {
+  if (length < 14) {
+    send_zcl_default_response(reply, EMBER_ZCL_STATUS_MALFORMED_COMMAND);
+    return;
+  }
+  uint16_t manufacturer_code = emberAfGetInt16u(payload, 1, length);
+  uint16_t image_type = emberAfGetInt16u(payload, 3, length);
+  uint32_t file_version = emberAfGetInt32u(payload, 5, length);
+  uint32_t offset = emberAfGetInt32u(payload, 9, length);
+  uint8_t max_data_size = emberAfGetInt8u(payload, 13, length);
+  const ota_image_t* image = ota_images_find(
+    &ota_images, manufacturer_code, image_type, file_version
+  );
+  if (image && !ota_image_unchanged(image)) {
+    emberAfAppPrintln(
+      "WARNING: OTA image %s changed on disk, not serving it until restarted",
+      image->file_name
+    );
+    image = NULL;
+  }
+  // Copied out of the mapping, the file can still be truncated under it
+  uint8_t block[UINT8_MAX];
+  size_t max_block_size = MIN(
+    max_data_size,
+    emberAfMaximumApsPayloadLength(EMBER_OUTGOING_DIRECT, reply->source, cmd->apsFrame)
+      - OTA_IMAGE_BLOCK_RESPONSE_OVERHEAD
+  );
+  size_t block_size = image
+    ? ota_image_copy_block(image, offset, max_block_size, block)
+    : 0;
+  if (image && block_size == 0 && max_block_size > 0
+      && offset < image->image_size) {
+    emberAfAppPrintln(
+      "WARNING: OTA image %s truncated while serving it",
+      image->file_name
+    );
+  }
+  if (block_size == 0) {
+    emberAfFillExternalBuffer(
+      OTA_RESPONSE_FRAME_CONTROL,
+      ZCL_OTA_BOOTLOAD_CLUSTER_ID,
+      ZCL_IMAGE_BLOCK_RESPONSE_COMMAND_ID,
+      "u",
+      EMBER_ZCL_STATUS_ABORT
+    );
+    send_zcl_reply(reply);
+    return;
+  }
+  if (!ota_rate_limiter_take(&ota_rate_limiter, halCommonGetInt32uMillisecondTick())) {
+    // Have the client back off instead of letting block responses take
+    // over the bandwidth needed for routing. With a current time of 0
+    // the request time is relative, in seconds.
+    emberAfFillExternalBuffer(
+      OTA_RESPONSE_FRAME_CONTROL,
+      ZCL_OTA_BOOTLOAD_CLUSTER_ID,
+      ZCL_IMAGE_BLOCK_RESPONSE_COMMAND_ID,
+      "uwwv",
+      EMBER_ZCL_STATUS_WAIT_FOR_DATA,
+      0,
+      1,
+      1000 / OTA_SERVER_BLOCKS_PER_SECOND
+    );
+    send_zcl_reply(reply);
+    return;
+  }
+  emberAfFillExternalBuffer(
+    OTA_RESPONSE_FRAME_CONTROL,
+    ZCL_OTA_BOOTLOAD_CLUSTER_ID,
+    ZCL_IMAGE_BLOCK_RESPONSE_COMMAND_ID,
+    "uvvwwub",
+    EMBER_ZCL_STATUS_SUCCESS,
+    manufacturer_code,
+    image_type,
+    file_version,
+    offset,
+    (uint8_t)block_size,
+    block,
+    (uint16_t)block_size
+  );
+  send_zcl_reply(reply);
+}
+
+void handle_upgrade_end(const zcl_reply_t* reply, const uint8_t* payload, uint16_t length) {
+  if (length < 9) {
+    send_zcl_default_response(reply, EMBER_ZCL_STATUS_MALFORMED_COMMAND);
+    return;
+  }
+  uint8_t status = emberAfGetInt8u(payload, 0, length);
+  uint16_t manufacturer_code = emberAfGetInt16u(payload, 1, length);
+  uint16_t image_type = emberAfGetInt16u(payload, 3, length);
+  uint32_t file_version = emberAfGetInt32u(payload, 5, length);
+  if (status != EMBER_ZCL_STATUS_SUCCESS) {
+    logInfoln("Node 0x%04X aborted OTA upgrade, status 0x%02X", reply->source, status);
+    send_zcl_default_response(reply, EMBER_ZCL_STATUS_SUCCESS);
+    return;
+  }
+  logInfoln("Node 0x%04X finished downloading OTA image", reply->source);
+  // Current and upgrade time of 0 tell the client to upgrade right away
+  emberAfFillExternalBuffer(
+    OTA_RESPONSE_FRAME_CONTROL,
+    ZCL_OTA_BOOTLOAD_CLUSTER_ID,
+    ZCL_UPGRADE_END_RESPONSE_COMMAND_ID,
+    "vvwww",
+    manufacturer_code,
+    image_type,
+    file_version,
+    0,
+    0
+  );
+  send_zcl_reply(reply);
+}
+
+bool handle_ota_command(const EmberAfClusterCommand* cmd) {
+  zcl_reply_t reply;
+  zcl_reply_for_command(cmd, &reply);
+  const uint8_t* payload = cmd->buffer + cmd->payloadStartIndex;
+  uint16_t length = cmd->bufLen - cmd->payloadStartIndex;
+  switch (cmd->commandId) {
+    case ZCL_QUERY_NEXT_IMAGE_REQUEST_COMMAND_ID:
+      handle_query_next_image(&reply, payload, length);
+      return true;
+    case ZCL_IMAGE_BLOCK_REQUEST_COMMAND_ID:
+      handle_image_block(cmd, &reply, payload, length);
+      return true;
+    case ZCL_UPGRADE_END_REQUEST_COMMAND_ID:
+      handle_upgrade_end(&reply, payload, length);
+      return true;
+    default:
+      return false;
+  }
+}
+
+void on_action_done(const action_t* action, ACTION_RESULT result, int exit_status, void* context) {
+  logInfoln("Action \"%s\" finished: %s", action->command, decode_action_result_short(result));
+  on_action_event(action, result, exit_status);
+  send_zcl_default_response((const zcl_reply_t*)context, action_result_to_zcl_status(result));
+}
+
+bool emberAfPreCommandReceivedCallback(EmberAfClusterCommand* cmd) {
+  if (!cmd->clusterSpecific
+      || cmd->mfgSpecific
+      || cmd->direction != ZCL_DIRECTION_CLIENT_TO_SERVER) {
+    return false;
+  }
+  if (ota_images.count > 0 && cmd->apsFrame->clusterId == ZCL_OTA_BOOTLOAD_CLUSTER_ID) {
+    return handle_ota_command(cmd);
+  }
+  const action_t* action = actions_find(
+    &action_executor,
+    cmd->apsFrame->destinationEndpoint,
+    cmd->apsFrame->clusterId,
+    cmd->commandId
+  );
+  if (!action) {
+    return false;
+  }
+  zcl_reply_t reply;
+  zcl_reply_for_command(cmd, &reply);
+  // The response is sent from on_action_done once the command exits
+  ACTION_RESULT result = actions_start(
+    &action_executor, action, on_action_done, &reply, sizeof(reply)
+  );
+  on_action_event(action, result, -1);
+  if (result != ACTION_RESULT_STARTED) {
+    logInfoln("Failed to start action \"%s\": %s", action->command, decode_action_result_short(result));
+    send_zcl_default_response(&reply, EMBER_ZCL_STATUS_FAILURE);
+  }
+  return true;
+}
+
 #ifdef EMBER_TEST
 int nodeMain(void)
 #else
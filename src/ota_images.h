@@ -0,0 +1,348 @@
+#ifndef OTA_IMAGES_H
+#define OTA_IMAGES_H
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "byte_order.h"
+
+#define OTA_IMAGES_MAX 16
+#define OTA_FILE_NAME_MAX_LENGTH 255
+#define OTA_FILE_EXTENSION ".ota"
+#define OTA_HEADER_MAGIC 0x0BEEF11E
+#define OTA_HEADER_MIN_LENGTH 56
+#define OTA_HEADER_HARDWARE_VERSIONS_PRESENT 0x0004
+
+// An upgrade image, mapped in memory as a whole so that block requests
+// are served without going through read()
+typedef struct {
+  uint16_t manufacturer_code;
+  uint16_t image_type;
+  uint32_t file_version;
+  uint16_t header_length;
+  // Total size of the image as per the header, which is what's served
+  uint32_t image_size;
+  bool has_hardware_versions;
+  uint16_t min_hardware_version;
+  uint16_t max_hardware_version;
+  const uint8_t *data;
+  size_t mapped_size;
+  // Kept open to check that the file wasn't modified under the mapping,
+  // or replaced in the directory
+  int fd;
+  int dir_fd;
+  ino_t inode;
+  struct timespec modified;
+  char file_name[OTA_FILE_NAME_MAX_LENGTH+1];
+} ota_image_t;
+
+typedef struct {
+  ota_image_t images[OTA_IMAGES_MAX];
+  size_t count;
+  int dir_fd;
+} ota_images_t;
+
+/*
+ * Parses the OTA file header at the start of `data` into `image`,
+ * see section 11.4 of the ZigBee Cluster Library specification.
+ * `data` and `mapped_size` aren't touched. Returns false if the header
+ * is invalid or the image is larger than `size`.
+ */
+bool parse_ota_header(const uint8_t *data, size_t size, ota_image_t *image) {
+  if (size < OTA_HEADER_MIN_LENGTH) {
+    return false;
+  }
+  uint32_t magic;
+  get_le32(data, &magic);
+  if (magic != OTA_HEADER_MAGIC) {
+    return false;
+  }
+  uint16_t header_length, field_control;
+  uint32_t image_size;
+  get_le16(data + 6, &header_length);
+  get_le16(data + 8, &field_control);
+  get_le32(data + 52, &image_size);
+  if (header_length < OTA_HEADER_MIN_LENGTH || header_length > image_size ||
+      image_size > size) {
+    return false;
+  }
+  image->header_length = header_length;
+  get_le16(data + 10, &image->manufacturer_code);
+  get_le16(data + 12, &image->image_type);
+  get_le32(data + 14, &image->file_version);
+  image->image_size = image_size;
+  image->has_hardware_versions =
+    field_control & OTA_HEADER_HARDWARE_VERSIONS_PRESENT;
+  if (image->has_hardware_versions) {
+    // Last optional field, after the security credential version and
+    // the upgrade file destination when those are present
+    if (header_length < OTA_HEADER_MIN_LENGTH + 4) {
+      return false;
+    }
+    get_le16(data + header_length - 4, &image->min_hardware_version);
+    get_le16(data + header_length - 2, &image->max_hardware_version);
+  }
+  return true;
+}
+
+static bool has_ota_extension(const char *file_name) {
+  size_t len = strlen(file_name);
+  size_t ext_len = sizeof(OTA_FILE_EXTENSION) - 1;
+  return len > ext_len &&
+         strcmp(file_name + len - ext_len, OTA_FILE_EXTENSION) == 0;
+}
+
+/*
+ * Maps the file at `path` and parses its header. On failure
+ * nothing is left mapped.
+ */
+bool ota_image_map(const char *path, ota_image_t *image) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+  if (!parse_ota_header(data, st.st_size, image)) {
+    munmap(data, st.st_size);
+    close(fd);
+    return false;
+  }
+  image->data = data;
+  image->mapped_size = st.st_size;
+  image->fd = fd;
+  image->inode = st.st_ino;
+  image->modified = st.st_mtim;
+  return true;
+}
+
+/*
+ * Indexes every `.ota` file in `dir_name`. Files that can't be mapped
+ * or don't have a valid header are counted in `skipped`, as are the ones
+ * past `OTA_IMAGES_MAX`. Returns false if the directory can't be opened.
+ */
+bool ota_images_load(ota_images_t *images, const char *dir_name,
+                     size_t *skipped) {
+  memset(images, 0, sizeof(*images));
+  *skipped = 0;
+  images->dir_fd = open(dir_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (images->dir_fd == -1) {
+    return false;
+  }
+  DIR *dir = opendir(dir_name);
+  if (!dir) {
+    close(images->dir_fd);
+    images->dir_fd = -1;
+    return false;
+  }
+  struct dirent *entry;
+  char path[PATH_MAX];
+  while ((entry = readdir(dir)) != NULL) {
+    if (!has_ota_extension(entry->d_name)) {
+      continue;
+    }
+    ota_image_t *image = &images->images[images->count];
+    if (images->count >= OTA_IMAGES_MAX ||
+        snprintf(path, sizeof(path), "%s/%s", dir_name, entry->d_name) >=
+          (int)sizeof(path) ||
+        strlen(entry->d_name) > OTA_FILE_NAME_MAX_LENGTH ||
+        !ota_image_map(path, image)) {
+      (*skipped)++;
+      continue;
+    }
+    strcpy(image->file_name, entry->d_name);
+    image->dir_fd = images->dir_fd;
+    images->count++;
+  }
+  closedir(dir);
+  return true;
+}
+
+void ota_images_close(ota_images_t *images) {
+  for (size_t i = 0; i < images->count; i++) {
+    munmap((void*)images->images[i].data, images->images[i].mapped_size);
+    close(images->images[i].fd);
+  }
+  images->count = 0;
+  if (images->dir_fd != -1) {
+    close(images->dir_fd);
+    images->dir_fd = -1;
+  }
+}
+
+static bool hardware_version_matches(const ota_image_t *image,
+                                     int hardware_version) {
+  return !image->has_hardware_versions || hardware_version < 0 ||
+         (hardware_version >= image->min_hardware_version &&
+          hardware_version <= image->max_hardware_version);
+}
+
+/*
+ * Finds the newest image for a device running `current_version`,
+ * `hardware_version` is ignored when negative. Returns NULL if there's
+ * nothing newer.
+ */
+const ota_image_t* ota_images_find_next(const ota_images_t *images,
+                                        uint16_t manufacturer_code,
+                                        uint16_t image_type,
+                                        uint32_t current_version,
+                                        int hardware_version) {
+  const ota_image_t *next = NULL;
+  for (size_t i = 0; i < images->count; i++) {
+    const ota_image_t *image = &images->images[i];
+    if (image->manufacturer_code != manufacturer_code ||
+        image->image_type != image_type ||
+        image->file_version <= current_version ||
+        !hardware_version_matches(image, hardware_version)) {
+      continue;
+    }
+    if (!next || image->file_version > next->file_version) {
+      next = image;
+    }
+  }
+  return next;
+}
+
+const ota_image_t* ota_images_find(const ota_images_t *images,
+                                   uint16_t manufacturer_code,
+                                   uint16_t image_type,
+                                   uint32_t file_version) {
+  for (size_t i = 0; i < images->count; i++) {
+    const ota_image_t *image = &images->images[i];
+    if (image->manufacturer_code == manufacturer_code &&
+        image->image_type == image_type &&
+        image->file_version == file_version) {
+      return image;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Checks that the file is still the one that was indexed, and that it's
+ * still there under its name. Files written over in place get truncated
+ * first, and reading the mapping past the new end of the file raises
+ * SIGBUS. Files renamed over it are left to the next restart to index.
+ * This only narrows the window, copy blocks with ota_image_copy_block.
+ */
+bool ota_image_unchanged(const ota_image_t *image) {
+  struct stat st;
+  if (fstat(image->fd, &st) != 0 ||
+      (size_t)st.st_size != image->mapped_size ||
+      st.st_mtim.tv_sec != image->modified.tv_sec ||
+      st.st_mtim.tv_nsec != image->modified.tv_nsec) {
+    return false;
+  }
+  return fstatat(image->dir_fd, image->file_name, &st, 0) == 0 &&
+         st.st_ino == image->inode;
+}
+
+/*
+ * Points `block` to the data at `offset`, and returns its length,
+ * at most `max_size`. Returns 0 when `offset` is at or past the end of
+ * the image.
+ */
+size_t ota_image_block(const ota_image_t *image, uint32_t offset,
+                       size_t max_size, const uint8_t **block) {
+  if (offset >= image->image_size) {
+    return 0;
+  }
+  size_t remaining = image->image_size - offset;
+  *block = image->data + offset;
+  return remaining < max_size ? remaining : max_size;
+}
+
+static sigjmp_buf ota_copy_fault;
+
+static void ota_on_copy_fault(int signal) {
+  siglongjmp(ota_copy_fault, 1);
+}
+
+/*
+ * Copies the data at `offset` into `block`, at most `max_size` bytes.
+ * The file can still be truncated after ota_image_unchanged, so SIGBUS
+ * is caught while copying. Returns the length copied, 0 when `offset` is
+ * at or past the end of the image or the mapping faulted.
+ */
+size_t ota_image_copy_block(const ota_image_t *image, uint32_t offset,
+                            size_t max_size, uint8_t *block) {
+  const uint8_t *data;
+  size_t size = ota_image_block(image, offset, max_size, &data);
+  if (size == 0) {
+    return 0;
+  }
+  struct sigaction action, previous;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = ota_on_copy_fault;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGBUS, &action, &previous) != 0) {
+    return 0;
+  }
+  volatile size_t copied = 0;
+  if (sigsetjmp(ota_copy_fault, 1) == 0) {
+    memcpy(block, data, size);
+    copied = size;
+  }
+  sigaction(SIGBUS, &previous, NULL);
+  return copied;
+}
+
+// Token bucket shared by all block requests. Tokens are kept in
+// thousandths of a block so that refilling works with millisecond ticks.
+typedef struct {
+  uint32_t blocks_per_second;
+  uint32_t burst;
+  uint32_t milli_tokens;
+  uint32_t last_ms;
+} ota_rate_limiter_t;
+
+void ota_rate_limiter_init(ota_rate_limiter_t *limiter,
+                           uint32_t blocks_per_second, uint32_t burst,
+                           uint32_t now_ms) {
+  limiter->blocks_per_second = blocks_per_second;
+  limiter->burst = burst;
+  limiter->milli_tokens = burst * 1000;
+  limiter->last_ms = now_ms;
+}
+
+/*
+ * Takes a token for a block response if there's one available.
+ * `now_ms` may wrap around.
+ */
+bool ota_rate_limiter_take(ota_rate_limiter_t *limiter, uint32_t now_ms) {
+  uint32_t elapsed_ms = now_ms - limiter->last_ms;
+  limiter->last_ms = now_ms;
+  uint64_t milli_tokens = limiter->milli_tokens +
+                          (uint64_t)elapsed_ms * limiter->blocks_per_second;
+  uint64_t max_milli_tokens = (uint64_t)limiter->burst * 1000;
+  if (milli_tokens > max_milli_tokens) {
+    milli_tokens = max_milli_tokens;
+  }
+  bool took = milli_tokens >= 1000;
+  if (took) {
+    milli_tokens -= 1000;
+  }
+  limiter->milli_tokens = (uint32_t)milli_tokens;
+  return took;
+}
+
+#endif /* OTA_IMAGES_H */
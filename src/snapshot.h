@@ -0,0 +1,222 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "byte_order.h"
+
+#define SNAPSHOT_MAGIC "EZRS"
+#define SNAPSHOT_MAGIC_SIZE 4
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_EUI64_SIZE 8
+#define SNAPSHOT_KEY_SIZE 16
+// Magic, version and payload length
+#define SNAPSHOT_HEADER_SIZE (SNAPSHOT_MAGIC_SIZE + 2 + 2)
+#define SNAPSHOT_PAYLOAD_SIZE 78
+#define SNAPSHOT_CHECKSUM_SIZE 4
+#define SNAPSHOT_FILE_SIZE \
+  (SNAPSHOT_HEADER_SIZE + SNAPSHOT_PAYLOAD_SIZE + SNAPSHOT_CHECKSUM_SIZE)
+#define SNAPSHOT_TEMP_SUFFIX ".tmp"
+
+// Everything needed for a new NCP to take the place of the one the
+// snapshot was taken from
+typedef struct {
+  uint8_t eui64[SNAPSHOT_EUI64_SIZE];
+  uint16_t node_id;
+  uint8_t extended_pan_id[SNAPSHOT_EUI64_SIZE];
+  uint16_t pan_id;
+  int8_t radio_tx_power;
+  uint8_t radio_channel;
+  uint8_t nwk_update_id;
+  uint16_t nwk_manager_id;
+  uint32_t channels;
+  uint8_t network_key[SNAPSHOT_KEY_SIZE];
+  uint8_t network_key_sequence;
+  uint32_t network_frame_counter;
+  uint8_t trust_center_eui64[SNAPSHOT_EUI64_SIZE];
+  uint8_t trust_center_link_key[SNAPSHOT_KEY_SIZE];
+  uint32_t aps_frame_counter;
+} network_snapshot_t;
+
+typedef enum {
+  SNAPSHOT_RESULT_OK,
+  SNAPSHOT_RESULT_IO_ERROR,
+  SNAPSHOT_RESULT_BAD_MAGIC,
+  SNAPSHOT_RESULT_BAD_VERSION,
+  SNAPSHOT_RESULT_BAD_LENGTH,
+  SNAPSHOT_RESULT_BAD_CHECKSUM
+} SNAPSHOT_RESULT;
+
+const char* decode_snapshot_result_short(SNAPSHOT_RESULT result) {
+  switch (result) {
+    case SNAPSHOT_RESULT_OK: return "ok";
+    case SNAPSHOT_RESULT_IO_ERROR: return "io_error";
+    case SNAPSHOT_RESULT_BAD_MAGIC: return "bad_magic";
+    case SNAPSHOT_RESULT_BAD_VERSION: return "bad_version";
+    case SNAPSHOT_RESULT_BAD_LENGTH: return "bad_length";
+    case SNAPSHOT_RESULT_BAD_CHECKSUM: return "bad_checksum";
+  }
+  assert(0);
+}
+
+uint32_t snapshot_crc32(const uint8_t *data, size_t length) {
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < length; i++) {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+static uint8_t* snapshot_put_bytes(uint8_t *out, const uint8_t *data,
+                                   size_t length) {
+  memcpy(out, data, length);
+  return out + length;
+}
+
+static const uint8_t* snapshot_get_bytes(const uint8_t *in, uint8_t *data,
+                                         size_t length) {
+  memcpy(data, in, length);
+  return in + length;
+}
+
+/*
+ * Serializes `snapshot` into `out`, which must hold SNAPSHOT_FILE_SIZE
+ * bytes. Fields are written one by one in little endian so that files
+ * can be moved between hosts of different endianness.
+ */
+void snapshot_encode(const network_snapshot_t *snapshot, uint8_t *out) {
+  uint8_t *start = out;
+  out = snapshot_put_bytes(out, (const uint8_t*)SNAPSHOT_MAGIC,
+                           SNAPSHOT_MAGIC_SIZE);
+  out = put_le16(out, SNAPSHOT_VERSION);
+  out = put_le16(out, SNAPSHOT_PAYLOAD_SIZE);
+  out = snapshot_put_bytes(out, snapshot->eui64, SNAPSHOT_EUI64_SIZE);
+  out = put_le16(out, snapshot->node_id);
+  out = snapshot_put_bytes(out, snapshot->extended_pan_id, SNAPSHOT_EUI64_SIZE);
+  out = put_le16(out, snapshot->pan_id);
+  *out++ = (uint8_t)snapshot->radio_tx_power;
+  *out++ = snapshot->radio_channel;
+  *out++ = snapshot->nwk_update_id;
+  out = put_le16(out, snapshot->nwk_manager_id);
+  out = put_le32(out, snapshot->channels);
+  out = snapshot_put_bytes(out, snapshot->network_key, SNAPSHOT_KEY_SIZE);
+  *out++ = snapshot->network_key_sequence;
+  out = put_le32(out, snapshot->network_frame_counter);
+  out = snapshot_put_bytes(out, snapshot->trust_center_eui64,
+                           SNAPSHOT_EUI64_SIZE);
+  out = snapshot_put_bytes(out, snapshot->trust_center_link_key,
+                           SNAPSHOT_KEY_SIZE);
+  out = put_le32(out, snapshot->aps_frame_counter);
+  assert(out - start == SNAPSHOT_HEADER_SIZE + SNAPSHOT_PAYLOAD_SIZE);
+  put_le32(out, snapshot_crc32(start, out - start));
+}
+
+SNAPSHOT_RESULT snapshot_decode(const uint8_t *in, size_t length,
+                                network_snapshot_t *snapshot) {
+  const uint8_t *start = in;
+  if (length < SNAPSHOT_HEADER_SIZE) {
+    return SNAPSHOT_RESULT_BAD_LENGTH;
+  }
+  if (memcmp(in, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE) != 0) {
+    return SNAPSHOT_RESULT_BAD_MAGIC;
+  }
+  in += SNAPSHOT_MAGIC_SIZE;
+  uint16_t version, payload_size;
+  in = get_le16(in, &version);
+  in = get_le16(in, &payload_size);
+  if (version != SNAPSHOT_VERSION) {
+    return SNAPSHOT_RESULT_BAD_VERSION;
+  }
+  if (payload_size != SNAPSHOT_PAYLOAD_SIZE || length != SNAPSHOT_FILE_SIZE) {
+    return SNAPSHOT_RESULT_BAD_LENGTH;
+  }
+  uint32_t checksum;
+  get_le32(start + SNAPSHOT_HEADER_SIZE + SNAPSHOT_PAYLOAD_SIZE,
+                    &checksum);
+  if (checksum != snapshot_crc32(start,
+                                 SNAPSHOT_HEADER_SIZE + SNAPSHOT_PAYLOAD_SIZE)) {
+    return SNAPSHOT_RESULT_BAD_CHECKSUM;
+  }
+  in = snapshot_get_bytes(in, snapshot->eui64, SNAPSHOT_EUI64_SIZE);
+  in = get_le16(in, &snapshot->node_id);
+  in = snapshot_get_bytes(in, snapshot->extended_pan_id, SNAPSHOT_EUI64_SIZE);
+  in = get_le16(in, &snapshot->pan_id);
+  snapshot->radio_tx_power = (int8_t)*in++;
+  snapshot->radio_channel = *in++;
+  snapshot->nwk_update_id = *in++;
+  in = get_le16(in, &snapshot->nwk_manager_id);
+  in = get_le32(in, &snapshot->channels);
+  in = snapshot_get_bytes(in, snapshot->network_key, SNAPSHOT_KEY_SIZE);
+  snapshot->network_key_sequence = *in++;
+  in = get_le32(in, &snapshot->network_frame_counter);
+  in = snapshot_get_bytes(in, snapshot->trust_center_eui64,
+                          SNAPSHOT_EUI64_SIZE);
+  in = snapshot_get_bytes(in, snapshot->trust_center_link_key,
+                          SNAPSHOT_KEY_SIZE);
+  get_le32(in, &snapshot->aps_frame_counter);
+  return SNAPSHOT_RESULT_OK;
+}
+
+/*
+ * Writes the snapshot to `<file_name>.tmp` and renames it over
+ * `file_name`, so that a crash never leaves a half written snapshot
+ * behind. The file holds the network key, it's created readable only
+ * by the owner.
+ */
+SNAPSHOT_RESULT snapshot_write_file(const char *file_name,
+                                    const network_snapshot_t *snapshot) {
+  uint8_t data[SNAPSHOT_FILE_SIZE];
+  snapshot_encode(snapshot, data);
+  char temp_name[PATH_MAX];
+  if (snprintf(temp_name, sizeof(temp_name), "%s%s", file_name,
+               SNAPSHOT_TEMP_SUFFIX) >= (int)sizeof(temp_name)) {
+    errno = ENAMETOOLONG;
+    return SNAPSHOT_RESULT_IO_ERROR;
+  }
+  int fd = open(temp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    return SNAPSHOT_RESULT_IO_ERROR;
+  }
+  bool written = write(fd, data, sizeof(data)) == sizeof(data) &&
+                 fsync(fd) == 0;
+  int write_errno = errno;
+  close(fd);
+  if (!written || rename(temp_name, file_name) != 0) {
+    if (!written) {
+      errno = write_errno;
+    }
+    remove(temp_name);
+    return SNAPSHOT_RESULT_IO_ERROR;
+  }
+  return SNAPSHOT_RESULT_OK;
+}
+
+SNAPSHOT_RESULT snapshot_read_file(const char *file_name,
+                                   network_snapshot_t *snapshot) {
+  // One byte more than expected to tell apart files that are too long
+  uint8_t data[SNAPSHOT_FILE_SIZE + 1];
+  FILE *file = fopen(file_name, "rb");
+  if (!file) {
+    return SNAPSHOT_RESULT_IO_ERROR;
+  }
+  size_t length = fread(data, 1, sizeof(data), file);
+  bool failed = ferror(file);
+  fclose(file);
+  if (failed) {
+    return SNAPSHOT_RESULT_IO_ERROR;
+  }
+  return snapshot_decode(data, length, snapshot);
+}
+
+#endif /* SNAPSHOT_H */
@@ -0,0 +1,145 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "../actions.h"
+
+typedef struct {
+  int calls;
+  ACTION_RESULT result;
+  int exit_status;
+} done_record_t;
+
+void record_done(const action_t *action, ACTION_RESULT result,
+                 int exit_status, void *context) {
+  done_record_t *record = *(done_record_t**)context;
+  printf("Action '%s' done: %s, exit status %d\n", action->command,
+         decode_action_result_short(result), exit_status);
+  record->calls++;
+  record->result = result;
+  record->exit_status = exit_status;
+}
+
+#define PARSE(LINE, OK)                          \
+  printf("Parsing %s\n", #LINE);                 \
+  assert(parse_action(LINE, &action) == OK)
+
+void test_parse_action() {
+  action_t action;
+  PARSE("1 0x0006 0x01 5000 systemctl restart foo\n", true);
+  assert(action.endpoint == 1);
+  assert(action.cluster_id == 0x0006);
+  assert(action.command_id == 0x01);
+  assert(action.timeout_ms == 5000);
+  assert(strcmp(action.command, "systemctl restart foo") == 0);
+  PARSE("2 3 0 100 reboot", true);
+  assert(strcmp(action.command, "reboot") == 0);
+  PARSE("1 0x0006 0x01 5000", false);
+  PARSE("1 0x0006 0x01 5000 \n", false);
+  PARSE("256 0x0006 0x01 5000 true", false);
+  PARSE("1 0x10000 0x01 5000 true", false);
+  PARSE("1 6 -1 5000 true", false);
+}
+
+void test_load_actions() {
+  action_executor_t executor = {};
+  const char contents[] =
+    "# endpoint cluster command timeout command\n"
+    "\n"
+    "1 0x0006 0x00 1000 true\n"
+    "  1 0x0006 0x01 1000 false\n"
+    "bad line\n";
+  FILE *file = fmemopen((void*)contents, sizeof(contents) - 1, "r");
+  int bad_line = 0;
+  assert(!actions_load(&executor, file, &bad_line));
+  fclose(file);
+  assert(bad_line == 5);
+  assert(executor.actions_count == 2);
+  assert(actions_find(&executor, 1, 0x0006, 0x01) == &executor.actions[1]);
+  assert(actions_find(&executor, 2, 0x0006, 0x01) == NULL);
+}
+
+void wait_for_actions(action_executor_t *executor) {
+  while (actions_running(executor) > 0) {
+    usleep(1000);
+    actions_poll(executor);
+  }
+}
+
+#define START(ACTION, RECORD, RESULT)                                   \
+  {                                                                     \
+    done_record_t *context = &RECORD;                                   \
+    assert(actions_start(&executor, &ACTION, record_done, &context,     \
+                         sizeof(context)) == RESULT);                   \
+  }
+
+void test_run_actions() {
+  action_executor_t executor;
+  assert(actions_init(&executor));
+  action_t succeeds, fails, hangs;
+  assert(parse_action("1 6 1 1000 exit 0", &succeeds));
+  assert(parse_action("1 6 0 1000 exit 3", &fails));
+  assert(parse_action("1 6 2 50 sleep 10", &hangs));
+
+  done_record_t success_record = {}, fail_record = {}, hang_record = {};
+  START(succeeds, success_record, ACTION_RESULT_STARTED);
+  START(fails, fail_record, ACTION_RESULT_STARTED);
+  START(hangs, hang_record, ACTION_RESULT_STARTED);
+  assert(actions_running(&executor) == 3);
+  wait_for_actions(&executor);
+
+  assert(success_record.calls == 1);
+  assert(success_record.result == ACTION_RESULT_SUCCESS);
+  assert(success_record.exit_status == 0);
+  assert(fail_record.calls == 1);
+  assert(fail_record.result == ACTION_RESULT_FAILED);
+  assert(fail_record.exit_status == 3);
+  assert(hang_record.calls == 1);
+  assert(hang_record.result == ACTION_RESULT_TIMEOUT);
+}
+
+void test_concurrency_limit() {
+  action_executor_t executor;
+  assert(actions_init(&executor));
+  action_t hangs;
+  assert(parse_action("1 6 2 50 sleep 10", &hangs));
+
+  done_record_t records[ACTIONS_MAX_RUNNING + 1] = {};
+  for (size_t i = 0; i < ACTIONS_MAX_RUNNING; i++) {
+    START(hangs, records[i], ACTION_RESULT_STARTED);
+  }
+  START(hangs, records[ACTIONS_MAX_RUNNING], ACTION_RESULT_BUSY);
+  wait_for_actions(&executor);
+  for (size_t i = 0; i < ACTIONS_MAX_RUNNING; i++) {
+    assert(records[i].calls == 1);
+    assert(records[i].result == ACTION_RESULT_TIMEOUT);
+  }
+  assert(records[ACTIONS_MAX_RUNNING].calls == 0);
+}
+
+// The router ignores SIGPIPE, commands must still start with it set to
+// the default action
+void test_signal_dispositions() {
+  action_executor_t executor;
+  assert(actions_init(&executor));
+  signal(SIGPIPE, SIG_IGN);
+  action_t checks_signals;
+  assert(parse_action(
+    "1 6 3 1000 test $(( 0x$(sed -n 's/^SigIgn:[[:space:]]*//p' /proc/self/status) & 0x1000 )) -eq 0",
+    &checks_signals
+  ));
+  done_record_t record = {};
+  START(checks_signals, record, ACTION_RESULT_STARTED);
+  wait_for_actions(&executor);
+  assert(record.calls == 1);
+  assert(record.result == ACTION_RESULT_SUCCESS);
+  signal(SIGPIPE, SIG_DFL);
+}
+
+int main() {
+  test_parse_action();
+  test_load_actions();
+  test_run_actions();
+  test_concurrency_limit();
+  test_signal_dispositions();
+}
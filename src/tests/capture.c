@@ -0,0 +1,145 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../capture.h"
+
+capture_t capture;
+
+void capture_frames(size_t count, size_t payload_length) {
+  uint8_t payload[CAPTURE_MAX_PAYLOAD * 2];
+  for (size_t i = 0; i < sizeof(payload); i++) {
+    payload[i] = i;
+  }
+  for (size_t i = 0; i < count; i++) {
+    capture_frame_t *frame = capture_reserve(&capture);
+    if (!frame) {
+      continue;
+    }
+    frame->delivery = CAPTURE_DELIVERY_UNICAST;
+    frame->sender = 0x1234;
+    frame->rssi = -60;
+    frame->lqi = 255;
+    frame->profile_id = 0x0104;
+    frame->cluster_id = 0x0006;
+    frame->source_endpoint = 1;
+    frame->destination_endpoint = 2;
+    frame->sequence = i;
+    capture_set_payload(&capture, frame, payload, payload_length);
+    capture_commit(&capture);
+  }
+}
+
+size_t count_records(const char *path, uint32_t *link_type) {
+  FILE *file = fopen(path, "r");
+  assert(file);
+  uint8_t header[24];
+  assert(fread(header, 1, sizeof(header), file) == sizeof(header));
+  uint32_t magic;
+  memcpy(&magic, header, sizeof(magic));
+  assert(magic == 0xA1B2C3D4);
+  memcpy(link_type, header + 20, sizeof(*link_type));
+  size_t records = 0;
+  uint8_t record_header[CAPTURE_PCAP_RECORD_HEADER_SIZE];
+  while (fread(record_header, 1, sizeof(record_header), file) ==
+         sizeof(record_header)) {
+    uint32_t length;
+    memcpy(&length, record_header + 8, sizeof(length));
+    assert(fseek(file, length, SEEK_CUR) == 0);
+    records++;
+  }
+  fclose(file);
+  return records;
+}
+
+void test_capture_to_file() {
+  char path[] = "/tmp/capture_XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd != -1);
+  close(fd);
+
+  capture_init(&capture);
+  capture_frames(1, 10);
+  assert(capture.stats.captured == 0);
+  assert(capture_start(&capture, path, 0xABCD, 0x0001, 0));
+
+  capture_frames(10, 10);
+  // Not enough for a batch, and the flush interval hasn't passed
+  assert(capture_poll(&capture, 10));
+  assert(capture.stats.bytes_written == 24);
+  assert(capture_poll(&capture, CAPTURE_FLUSH_INTERVAL_MS));
+  assert(capture.stats.captured == 10);
+
+  // Frames past the ring size are dropped until the writer catches up
+  capture_frames(CAPTURE_RING_SIZE + 5, CAPTURE_MAX_PAYLOAD + 1);
+  printf("Captured: %u, dropped: %u, truncated: %u\n",
+         capture.stats.captured, capture.stats.dropped,
+         capture.stats.truncated);
+  assert(capture.stats.dropped == 5);
+  assert(capture.stats.truncated == CAPTURE_RING_SIZE);
+  assert(capture_poll(&capture, CAPTURE_FLUSH_INTERVAL_MS * 2));
+  assert(capture_poll(&capture, CAPTURE_FLUSH_INTERVAL_MS * 3));
+  assert(capture.head == capture.tail);
+  assert(capture.batch_length == 0);
+  capture_stop(&capture);
+
+  uint32_t link_type;
+  size_t records = count_records(path, &link_type);
+  printf("Records in file: %zu\n", records);
+  assert(link_type == CAPTURE_LINKTYPE_IEEE802_15_4_TAP);
+  assert(records == 10 + CAPTURE_RING_SIZE);
+  remove(path);
+}
+
+// Stopping writes out what's still queued, more than fits in one batch
+void test_stop_flushes() {
+  char path[] = "/tmp/capture_XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd != -1);
+  close(fd);
+
+  capture_init(&capture);
+  assert(capture_start(&capture, path, 0xABCD, 0x0001, 0));
+  capture_frames(CAPTURE_RING_SIZE, CAPTURE_MAX_PAYLOAD);
+  assert(capture.stats.bytes_written == 24);
+  capture_stop(&capture);
+  assert(!capture_active(&capture));
+
+  uint32_t link_type;
+  assert(count_records(path, &link_type) == CAPTURE_RING_SIZE);
+  remove(path);
+}
+
+void test_encode_record() {
+  capture_init(&capture);
+  capture.pan_id = 0xABCD;
+  capture.node_id = 0x0001;
+  capture_frame_t frame = {};
+  frame.delivery = CAPTURE_DELIVERY_GROUP;
+  frame.sender = 0x1234;
+  frame.group_id = 0x0042;
+  frame.cluster_id = 0x0006;
+  frame.profile_id = 0x0104;
+  frame.source_endpoint = 1;
+  frame.sequence = 7;
+  frame.length = 3;
+  uint8_t record[CAPTURE_RECORD_MAX_SIZE];
+  size_t length = capture_encode_record(&capture, &frame, record);
+  assert(length == CAPTURE_RECORD_MAX_SIZE - CAPTURE_MAX_PAYLOAD + 3);
+  const uint8_t *mac = record + CAPTURE_PCAP_RECORD_HEADER_SIZE +
+                       CAPTURE_TAP_HEADER_SIZE;
+  const uint8_t expected_mac[] = {0x41, 0x88, 0x00, 0xCD, 0xAB, 0xFF, 0xFF,
+                                  0x34, 0x12};
+  assert(memcmp(mac, expected_mac, sizeof(expected_mac)) == 0);
+  const uint8_t *aps = mac + CAPTURE_MAC_HEADER_SIZE + CAPTURE_NWK_HEADER_SIZE;
+  const uint8_t expected_aps[] = {0x0C, 0x42, 0x00, 0x06, 0x00, 0x04, 0x01,
+                                  0x01, 0x07};
+  assert(memcmp(aps, expected_aps, sizeof(expected_aps)) == 0);
+}
+
+int main() {
+  test_encode_record();
+  test_capture_to_file();
+  test_stop_flushes();
+}
@@ -0,0 +1,221 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../client/ezsp_router_client.h"
+
+#define BENCH_EVENTS 1000000
+
+void test_round_trips() {
+  uint8_t frame[CONTROL_FRAME_MAX_SIZE];
+  control_message_t message;
+  control_parser_t parser;
+
+  control_action_event_t action = {
+    2, 0x0006, 0x01, CONTROL_ACTION_RESULT_TIMEOUT, -15
+  }, action_out;
+  size_t size = control_encode_action_event(frame, &action);
+  assert(size == CONTROL_HEADER_SIZE + CONTROL_ACTION_EVENT_SIZE);
+  assert(memcmp(frame, "\x82\x09\x00\x02\x06\x00\x01\x03\xF1\xFF\xFF\xFF", size) == 0);
+  control_parser_init(&parser);
+  size_t available;
+  memcpy(control_parser_space(&parser, &available), frame, size);
+  control_parser_fill(&parser, size);
+  assert(control_parser_next(&parser, &message) == CONTROL_PARSE_MESSAGE);
+  assert(control_decode_action_event(&message, &action_out));
+  assert(action_out.endpoint == 2 && action_out.cluster_id == 0x0006);
+  assert(action_out.command_id == 0x01);
+  assert(action_out.result == CONTROL_ACTION_RESULT_TIMEOUT);
+  assert(action_out.exit_status == -15);
+  // Wrong type for this decoder
+  control_neighbor_event_t neighbor_out;
+  assert(!control_decode_neighbor_event(&message, &neighbor_out));
+
+  control_neighbor_event_t neighbor = { 4, 0xABCD, 255, 1, 3, 7 };
+  control_encode_neighbor_event(frame, &neighbor);
+  assert(control_parser_next(&parser, &message) == CONTROL_PARSE_NEED_MORE);
+  memcpy(control_parser_space(&parser, &available), frame,
+         CONTROL_HEADER_SIZE + CONTROL_NEIGHBOR_EVENT_SIZE);
+  control_parser_fill(&parser, CONTROL_HEADER_SIZE + CONTROL_NEIGHBOR_EVENT_SIZE);
+  assert(control_parser_next(&parser, &message) == CONTROL_PARSE_MESSAGE);
+  assert(control_decode_neighbor_event(&message, &neighbor_out));
+  assert(neighbor_out.index == 4 && neighbor_out.node_id == 0xABCD);
+  assert(neighbor_out.lqi == 255 && neighbor_out.in_cost == 1);
+  assert(neighbor_out.out_cost == 3 && neighbor_out.age == 7);
+
+  control_capture_stats_event_t stats = { 1, 2, 3, 0xDEADBEEF, 5 }, stats_out;
+  size = control_encode_capture_stats_event(frame, &stats);
+  message = (control_message_t){ frame[0], CONTROL_CAPTURE_STATS_EVENT_SIZE,
+                                 frame + CONTROL_HEADER_SIZE };
+  assert(control_decode_capture_stats_event(&message, &stats_out));
+  assert(stats_out.bytes_written == 0xDEADBEEF && stats_out.rotations == 5);
+  message.length--;
+  assert(!control_decode_capture_stats_event(&message, &stats_out));
+
+  control_state_event_t state = {
+    CONTROL_STATE_NO_NETWORK, CONTROL_STATE_HALTED
+  }, state_out;
+  control_encode_state_event(frame, &state);
+  message = (control_message_t){ frame[0], CONTROL_STATE_EVENT_SIZE,
+                                 frame + CONTROL_HEADER_SIZE };
+  assert(control_decode_state_event(&message, &state_out));
+  assert(memcmp(frame, "\x81\x02\x00\x03\x08", 5) == 0);
+  assert(state_out.prev_state == CONTROL_STATE_NO_NETWORK);
+  assert(state_out.new_state == CONTROL_STATE_HALTED);
+}
+
+// Feeds a stream of frames one byte at a time
+void test_split_frames() {
+  uint8_t stream[64];
+  size_t size = control_encode(stream, CONTROL_MSG_COMMAND, "neighbors", 9);
+  size += control_encode(stream + size, CONTROL_MSG_TEXT_MODE, NULL, 0);
+  control_parser_t parser;
+  control_parser_init(&parser);
+  control_message_t message;
+  int messages = 0;
+  for (size_t i = 0; i < size; i++) {
+    size_t available;
+    *control_parser_space(&parser, &available) = stream[i];
+    control_parser_fill(&parser, 1);
+    while (control_parser_next(&parser, &message) == CONTROL_PARSE_MESSAGE) {
+      if (messages++ == 0) {
+        assert(message.type == CONTROL_MSG_COMMAND);
+        assert(message.length == 9);
+        assert(memcmp(message.value, "neighbors", 9) == 0);
+      } else {
+        assert(message.type == CONTROL_MSG_TEXT_MODE);
+        assert(message.length == 0);
+      }
+    }
+  }
+  assert(messages == 2);
+}
+
+// Messages that are too long get skipped, fed in pieces
+void test_too_long() {
+  static uint8_t stream[CONTROL_HEADER_SIZE + 2000 + 16];
+  control_put_header(stream, CONTROL_MSG_COMMAND, 2000);
+  memset(stream + CONTROL_HEADER_SIZE, 'x', 2000);
+  size_t size = CONTROL_HEADER_SIZE + 2000;
+  size += control_encode(stream + size, CONTROL_MSG_COMMAND, "exit", 4);
+
+  control_parser_t parser;
+  control_parser_init(&parser);
+  control_message_t message;
+  int too_long = 0, messages = 0;
+  size_t offset = 0;
+  while (offset < size) {
+    size_t available;
+    uint8_t *space = control_parser_space(&parser, &available);
+    assert(available > 0);
+    size_t chunk = available < 700 ? available : 700;
+    chunk = chunk < size - offset ? chunk : size - offset;
+    memcpy(space, stream + offset, chunk);
+    control_parser_fill(&parser, chunk);
+    offset += chunk;
+    CONTROL_PARSE_RESULT result;
+    while ((result = control_parser_next(&parser, &message)) !=
+           CONTROL_PARSE_NEED_MORE) {
+      if (result == CONTROL_PARSE_TOO_LONG) {
+        too_long++;
+        continue;
+      }
+      assert(message.length == 4 && memcmp(message.value, "exit", 4) == 0);
+      messages++;
+    }
+  }
+  assert(too_long == 1);
+  assert(messages == 1);
+}
+
+// What's left after the last message goes back to the text reader
+void test_pending() {
+  uint8_t stream[64];
+  size_t size = control_encode(stream, CONTROL_MSG_TEXT_MODE, NULL, 0);
+  memcpy(stream + size, "neighbors\n", 10);
+  size += 10;
+  control_parser_t parser;
+  control_parser_init(&parser);
+  size_t available;
+  memcpy(control_parser_space(&parser, &available), stream, size);
+  control_parser_fill(&parser, size);
+  control_message_t message;
+  assert(control_parser_next(&parser, &message) == CONTROL_PARSE_MESSAGE);
+  assert(message.type == CONTROL_MSG_TEXT_MODE);
+  const uint8_t *pending;
+  assert(control_parser_pending(&parser, &pending) == 10);
+  assert(memcmp(pending, "neighbors\n", 10) == 0);
+}
+
+double elapsed_seconds(const struct timespec *start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Neighbor events, the most frequent ones, formatted and parsed the way
+ * each mode does it on both ends of the fifo, without the fifo itself
+ */
+void bench_neighbor_events() {
+  static uint8_t stream[BENCH_EVENTS * (CONTROL_HEADER_SIZE + CONTROL_NEIGHBOR_EVENT_SIZE)];
+  struct timespec start;
+  unsigned long checksum = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < BENCH_EVENTS; i++) {
+    char line[64];
+    snprintf(line, sizeof(line), "neighbor %u 0x%04X %u %u %u %u\n",
+             i & 0xFF, i & 0xFFFF, 200u, 1u, 3u, 7u);
+    unsigned index, node_id, lqi, in_cost, out_cost, age;
+    assert(sscanf(line, "neighbor %u 0x%X %u %u %u %u", &index, &node_id,
+                  &lqi, &in_cost, &out_cost, &age) == 6);
+    checksum += node_id;
+  }
+  double text_seconds = elapsed_seconds(&start);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  size_t size = 0;
+  for (int i = 0; i < BENCH_EVENTS; i++) {
+    control_neighbor_event_t event = { i & 0xFF, i & 0xFFFF, 200, 1, 3, 7 };
+    size += control_encode_neighbor_event(stream + size, &event);
+  }
+  // Parsed in reads as large as the parser allows, like the client does
+  control_parser_t parser;
+  control_parser_init(&parser);
+  control_message_t message;
+  size_t offset = 0;
+  int decoded = 0;
+  while (offset < size) {
+    size_t available;
+    uint8_t *space = control_parser_space(&parser, &available);
+    size_t chunk = available < size - offset ? available : size - offset;
+    memcpy(space, stream + offset, chunk);
+    control_parser_fill(&parser, chunk);
+    offset += chunk;
+    while (control_parser_next(&parser, &message) == CONTROL_PARSE_MESSAGE) {
+      control_neighbor_event_t event;
+      assert(control_decode_neighbor_event(&message, &event));
+      checksum -= event.node_id;
+      decoded++;
+    }
+  }
+  double binary_seconds = elapsed_seconds(&start);
+  assert(decoded == BENCH_EVENTS);
+  assert(checksum == 0);
+
+  printf("%d neighbor events, text: %.0f events/s, binary: %.0f events/s (%.1fx)\n",
+         BENCH_EVENTS, BENCH_EVENTS / text_seconds,
+         BENCH_EVENTS / binary_seconds, text_seconds / binary_seconds);
+}
+
+int main() {
+  test_round_trips();
+  test_split_frames();
+  test_too_long();
+  test_pending();
+  bench_neighbor_events();
+}
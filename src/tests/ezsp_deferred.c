@@ -0,0 +1,64 @@
+#include <assert.h>
+#include <stdbool.h>
+
+#include "../ezsp_deferred.h"
+
+typedef struct {
+  uint32_t values[EZSP_DEFERRED_SIZE * 2];
+  size_t count;
+} value_log_t;
+
+void log_value(const ezsp_deferred_request_t *request) {
+  value_log_t *log = request->context;
+  log->values[log->count++] = request->argument;
+}
+
+ezsp_deferred_t deferred;
+
+// Defers another call from within one, like a table walk does
+void log_and_resubmit(const ezsp_deferred_request_t *request) {
+  log_value(request);
+  if (request->argument < 3) {
+    assert(ezsp_deferred_submit(&deferred, log_and_resubmit, request->context,
+                                request->argument + 1));
+  }
+}
+
+void test_order_and_bounds() {
+  ezsp_deferred_init(&deferred);
+  value_log_t log = {};
+  for (uint32_t i = 0; i < EZSP_DEFERRED_SIZE; i++) {
+    assert(ezsp_deferred_submit(&deferred, log_value, &log, i));
+  }
+  assert(!ezsp_deferred_submit(&deferred, log_value, &log, 100));
+  assert(deferred.rejected == 1);
+  assert(ezsp_deferred_run(&deferred, 5) == 5);
+  assert(log.count == 5);
+  assert(ezsp_deferred_pending(&deferred) == EZSP_DEFERRED_SIZE - 5);
+  assert(ezsp_deferred_run(&deferred, EZSP_DEFERRED_SIZE) ==
+         EZSP_DEFERRED_SIZE - 5);
+  for (uint32_t i = 0; i < EZSP_DEFERRED_SIZE; i++) {
+    assert(log.values[i] == i);
+  }
+  assert(ezsp_deferred_run(&deferred, 1) == 0);
+}
+
+void test_submit_while_running() {
+  ezsp_deferred_init(&deferred);
+  value_log_t log = {};
+  assert(ezsp_deferred_submit(&deferred, log_and_resubmit, &log, 0));
+  // Calls deferred while running wait for the next run
+  assert(ezsp_deferred_run(&deferred, 10) == 1);
+  assert(ezsp_deferred_run(&deferred, 10) == 1);
+  assert(ezsp_deferred_run(&deferred, 10) == 1);
+  assert(ezsp_deferred_run(&deferred, 10) == 1);
+  assert(ezsp_deferred_run(&deferred, 10) == 0);
+  assert(log.count == 4);
+  assert(log.values[3] == 3);
+  assert(deferred.completed == 4);
+}
+
+int main() {
+  test_order_and_bounds();
+  test_submit_while_running();
+}
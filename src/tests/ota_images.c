@@ -0,0 +1,255 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../ota_images.h"
+
+#define BENCH_BLOCK_SIZE 48
+#define BENCH_BLOCKS 1000000
+
+// Writes an image with a 56 byte header, followed by `payload_size`
+// bytes counting up from 0. With `hardware_versions`, the header is
+// extended by the optional min/max hardware versions.
+void write_image(const char *path, uint16_t manufacturer_code,
+                 uint16_t image_type, uint32_t file_version,
+                 size_t payload_size, bool hardware_versions) {
+  uint16_t header_length = OTA_HEADER_MIN_LENGTH + (hardware_versions ? 4 : 0);
+  size_t size = header_length + payload_size;
+  uint8_t *data = calloc(1, size);
+  put_le32(data, OTA_HEADER_MAGIC);
+  put_le16(data + 4, 0x0100);
+  put_le16(data + 6, header_length);
+  put_le16(data + 8,
+           hardware_versions ? OTA_HEADER_HARDWARE_VERSIONS_PRESENT : 0);
+  put_le16(data + 10, manufacturer_code);
+  put_le16(data + 12, image_type);
+  put_le32(data + 14, file_version);
+  put_le16(data + 18, 0x0002);
+  strcpy((char*)data + 20, "test image");
+  put_le32(data + 52, size);
+  if (hardware_versions) {
+    put_le16(data + 56, 1);
+    put_le16(data + 58, 2);
+  }
+  for (size_t i = 0; i < payload_size; i++) {
+    data[header_length + i] = i & 0xFF;
+  }
+  FILE *file = fopen(path, "w");
+  assert(file);
+  assert(fwrite(data, 1, size, file) == size);
+  fclose(file);
+  free(data);
+}
+
+void write_garbage(const char *path) {
+  FILE *file = fopen(path, "w");
+  assert(file);
+  fputs("not an ota image, but long enough to have a full header in it.", file);
+  fclose(file);
+}
+
+void make_images_dir(char *dir) {
+  assert(mkdtemp(dir));
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/a.ota", dir);
+  write_image(path, 0x1234, 0x0001, 0x00000002, 1000, false);
+  snprintf(path, sizeof(path), "%s/b.ota", dir);
+  write_image(path, 0x1234, 0x0001, 0x00000003, 1000, true);
+  snprintf(path, sizeof(path), "%s/big.ota", dir);
+  write_image(path, 0x1234, 0x0002, 0x00000001, 1 << 20, false);
+  snprintf(path, sizeof(path), "%s/garbage.ota", dir);
+  write_garbage(path);
+  snprintf(path, sizeof(path), "%s/ignored.txt", dir);
+  write_garbage(path);
+}
+
+void remove_images_dir(const char *dir) {
+  const char *names[] = {"a.ota", "b.ota", "big.ota", "garbage.ota", "ignored.txt"};
+  char path[PATH_MAX];
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+    remove(path);
+  }
+  remove(dir);
+}
+
+void test_load_and_find(const ota_images_t *images, size_t skipped) {
+  printf("Loaded %zu images, skipped %zu\n", images->count, skipped);
+  assert(images->count == 3);
+  assert(skipped == 1);
+
+  const ota_image_t *next = ota_images_find_next(images, 0x1234, 0x0001, 1, -1);
+  assert(next && next->file_version == 3);
+  assert(next->has_hardware_versions);
+  assert(next->min_hardware_version == 1 && next->max_hardware_version == 2);
+  assert(next->header_length == 60);
+  next = ota_images_find_next(images, 0x1234, 0x0001, 1, 5);
+  assert(next && next->file_version == 2);
+  assert(ota_images_find_next(images, 0x1234, 0x0001, 3, -1) == NULL);
+  assert(ota_images_find_next(images, 0x4321, 0x0001, 0, -1) == NULL);
+
+  assert(ota_images_find(images, 0x1234, 0x0001, 2) != NULL);
+  assert(ota_images_find(images, 0x1234, 0x0001, 4) == NULL);
+}
+
+void test_blocks(const ota_images_t *images) {
+  const ota_image_t *image = ota_images_find(images, 0x1234, 0x0001, 2);
+  assert(image->image_size == OTA_HEADER_MIN_LENGTH + 1000);
+  const uint8_t *block;
+  assert(ota_image_block(image, 0, 64, &block) == 64);
+  uint32_t magic;
+  get_le32(block, &magic);
+  assert(magic == OTA_HEADER_MAGIC);
+  assert(ota_image_block(image, OTA_HEADER_MIN_LENGTH + 10, 64, &block) == 64);
+  assert(block[0] == 10);
+  assert(ota_image_block(image, image->image_size - 5, 64, &block) == 5);
+  assert(ota_image_block(image, image->image_size, 64, &block) == 0);
+}
+
+void test_rate_limiter() {
+  ota_rate_limiter_t limiter;
+  ota_rate_limiter_init(&limiter, 10, 2, 0xFFFFFF00);
+  assert(ota_rate_limiter_take(&limiter, 0xFFFFFF00));
+  assert(ota_rate_limiter_take(&limiter, 0xFFFFFF00));
+  assert(!ota_rate_limiter_take(&limiter, 0xFFFFFF00));
+  // 100ms per block at 10 blocks/s, across the tick wrap around
+  assert(!ota_rate_limiter_take(&limiter, 0xFFFFFF00 + 99));
+  assert(ota_rate_limiter_take(&limiter, 0xFFFFFF00 + 100));
+  assert(!ota_rate_limiter_take(&limiter, 0xFFFFFF00 + 100));
+  // Doesn't go over the burst after being idle
+  assert(ota_rate_limiter_take(&limiter, 60000));
+  assert(ota_rate_limiter_take(&limiter, 60000));
+  assert(!ota_rate_limiter_take(&limiter, 60000));
+}
+
+#define BLOCK_RESPONSE_OVERHEAD 17
+
+/*
+ * Answers an image block request the way the router does, minus the
+ * rate limiter and the send: looks the image up, checks it's unchanged
+ * and builds the ZCL response with the block copied in. Returns the
+ * frame size, 0 if the request would be aborted.
+ */
+size_t serve_block(const ota_images_t *images, const uint8_t *request,
+                   uint8_t sequence, uint8_t *frame) {
+  uint16_t manufacturer_code, image_type;
+  uint32_t file_version, offset;
+  get_le16(request + 1, &manufacturer_code);
+  get_le16(request + 3, &image_type);
+  get_le32(request + 5, &file_version);
+  get_le32(request + 9, &offset);
+  uint8_t max_data_size = request[13];
+  const ota_image_t *image =
+    ota_images_find(images, manufacturer_code, image_type, file_version);
+  if (!image || !ota_image_unchanged(image)) {
+    return 0;
+  }
+  uint8_t *out = frame;
+  size_t block_size = ota_image_copy_block(image, offset, max_data_size,
+                                           out + BLOCK_RESPONSE_OVERHEAD);
+  if (block_size == 0) {
+    return 0;
+  }
+  *out++ = 0x19;  // Cluster specific, server to client, no default response
+  *out++ = sequence;
+  *out++ = 0x05;  // Image Block Response
+  *out++ = 0x00;  // SUCCESS
+  put_le16(out, manufacturer_code);
+  put_le16(out + 2, image_type);
+  put_le32(out + 4, file_version);
+  put_le32(out + 8, offset);
+  out[12] = block_size;
+  return BLOCK_RESPONSE_OVERHEAD + block_size;
+}
+
+// Measures how fast image block requests are answered on the host
+void bench_blocks(const ota_images_t *images) {
+  uint8_t request[14] = {0};
+  put_le16(request + 1, 0x1234);
+  put_le16(request + 3, 0x0002);
+  put_le32(request + 5, 1);
+  request[13] = BENCH_BLOCK_SIZE;
+  uint8_t frame[BLOCK_RESPONSE_OVERHEAD + 255];
+  struct timespec start, end;
+  uint32_t checksum = 0;
+  uint32_t offset = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (size_t i = 0; i < BENCH_BLOCKS; i++) {
+    put_le32(request + 9, offset);
+    size_t size = serve_block(images, request, i, frame);
+    if (size == 0) {
+      offset = 0;
+      continue;
+    }
+    checksum += frame[size - 1];
+    offset += size - BLOCK_RESPONSE_OVERHEAD;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds = (end.tv_sec - start.tv_sec) +
+                   (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("Served %d blocks of %d bytes in %.3fs: %.0f blocks/s (checksum %u)\n",
+         BENCH_BLOCKS, BENCH_BLOCK_SIZE, seconds, BENCH_BLOCKS / seconds,
+         checksum);
+}
+
+// Rewriting an indexed image in place must stop it from being served
+void test_rewritten(const ota_images_t *images, const char *dir) {
+  const ota_image_t *image = ota_images_find(images, 0x1234, 0x0001, 2);
+  assert(ota_image_unchanged(image));
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/a.ota", dir);
+  assert(truncate(path, 0) == 0);
+  assert(!ota_image_unchanged(image));
+  uint8_t request[14] = {0};
+  put_le16(request + 1, 0x1234);
+  put_le16(request + 3, 0x0001);
+  put_le32(request + 5, 2);
+  request[13] = BENCH_BLOCK_SIZE;
+  uint8_t frame[BLOCK_RESPONSE_OVERHEAD + 255];
+  assert(serve_block(images, request, 0, frame) == 0);
+  // Truncated after the check, the copy faults instead of crashing
+  uint8_t block[255];
+  assert(ota_image_copy_block(image, 0, sizeof(block), block) == 0);
+  assert(ota_image_copy_block(image, 0, sizeof(block), block) == 0);
+}
+
+// Touching an image, or renaming another file over it, also counts
+void test_replaced(const ota_images_t *images, const char *dir) {
+  const ota_image_t *image = ota_images_find(images, 0x1234, 0x0001, 3);
+  assert(ota_image_unchanged(image));
+  struct timespec times[2] = { image->modified, image->modified };
+  times[1].tv_nsec = (times[1].tv_nsec + 1) % 1000000000;
+  assert(futimens(image->fd, times) == 0);
+  assert(!ota_image_unchanged(image));
+  times[1] = image->modified;
+  assert(futimens(image->fd, times) == 0);
+  assert(ota_image_unchanged(image));
+
+  char path[PATH_MAX], new_path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/b.ota", dir);
+  snprintf(new_path, sizeof(new_path), "%s/b.ota.new", dir);
+  write_image(new_path, 0x1234, 0x0001, 0x00000003, 1000, true);
+  assert(rename(new_path, path) == 0);
+  assert(!ota_image_unchanged(image));
+  // The old file is still mapped and safe to read
+  uint8_t block[255];
+  assert(ota_image_copy_block(image, OTA_HEADER_MIN_LENGTH + 4, 16, block) == 16);
+}
+
+int main() {
+  char dir[] = "/tmp/ota_images_XXXXXX";
+  make_images_dir(dir);
+  ota_images_t images;
+  size_t skipped;
+  assert(ota_images_load(&images, dir, &skipped));
+  test_load_and_find(&images, skipped);
+  test_blocks(&images);
+  test_rate_limiter();
+  bench_blocks(&images);
+  test_rewritten(&images, dir);
+  test_replaced(&images, dir);
+  ota_images_close(&images);
+  remove_images_dir(dir);
+}
@@ -0,0 +1,102 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../snapshot.h"
+
+void fill_snapshot(network_snapshot_t *snapshot) {
+  memset(snapshot, 0, sizeof(*snapshot));
+  for (int i = 0; i < SNAPSHOT_EUI64_SIZE; i++) {
+    snapshot->eui64[i] = i;
+    snapshot->extended_pan_id[i] = 0xD0 + i;
+    snapshot->trust_center_eui64[i] = 0xE0 + i;
+  }
+  for (int i = 0; i < SNAPSHOT_KEY_SIZE; i++) {
+    snapshot->network_key[i] = 0x10 + i;
+    snapshot->trust_center_link_key[i] = 0x20 + i;
+  }
+  snapshot->node_id = 0x1234;
+  snapshot->pan_id = 0xABCD;
+  snapshot->radio_tx_power = -3;
+  snapshot->radio_channel = 15;
+  snapshot->nwk_update_id = 2;
+  snapshot->nwk_manager_id = 0x0000;
+  snapshot->channels = 0x07FFF800;
+  snapshot->network_key_sequence = 1;
+  snapshot->network_frame_counter = 0x01020304;
+  snapshot->aps_frame_counter = 0x0A0B0C0D;
+}
+
+void assert_snapshots_equal(const network_snapshot_t *a,
+                            const network_snapshot_t *b) {
+  assert(memcmp(a->eui64, b->eui64, SNAPSHOT_EUI64_SIZE) == 0);
+  assert(a->node_id == b->node_id);
+  assert(memcmp(a->extended_pan_id, b->extended_pan_id,
+                SNAPSHOT_EUI64_SIZE) == 0);
+  assert(a->pan_id == b->pan_id);
+  assert(a->radio_tx_power == b->radio_tx_power);
+  assert(a->radio_channel == b->radio_channel);
+  assert(a->nwk_update_id == b->nwk_update_id);
+  assert(a->nwk_manager_id == b->nwk_manager_id);
+  assert(a->channels == b->channels);
+  assert(memcmp(a->network_key, b->network_key, SNAPSHOT_KEY_SIZE) == 0);
+  assert(a->network_key_sequence == b->network_key_sequence);
+  assert(a->network_frame_counter == b->network_frame_counter);
+  assert(memcmp(a->trust_center_eui64, b->trust_center_eui64,
+                SNAPSHOT_EUI64_SIZE) == 0);
+  assert(memcmp(a->trust_center_link_key, b->trust_center_link_key,
+                SNAPSHOT_KEY_SIZE) == 0);
+  assert(a->aps_frame_counter == b->aps_frame_counter);
+}
+
+#define DECODE(DATA, LENGTH, RESULT)                                    \
+  printf("Decoding, expecting %s\n", #RESULT);                          \
+  assert(snapshot_decode(DATA, LENGTH, &decoded) == RESULT)
+
+void test_encode_decode() {
+  network_snapshot_t snapshot, decoded;
+  fill_snapshot(&snapshot);
+  uint8_t data[SNAPSHOT_FILE_SIZE];
+  snapshot_encode(&snapshot, data);
+  assert(memcmp(data, "EZRS\x01\x00", 6) == 0);
+  DECODE(data, sizeof(data), SNAPSHOT_RESULT_OK);
+  assert_snapshots_equal(&snapshot, &decoded);
+
+  DECODE(data, sizeof(data) - 1, SNAPSHOT_RESULT_BAD_LENGTH);
+  DECODE(data, 3, SNAPSHOT_RESULT_BAD_LENGTH);
+  data[20] ^= 0x01;
+  DECODE(data, sizeof(data), SNAPSHOT_RESULT_BAD_CHECKSUM);
+  data[20] ^= 0x01;
+  data[4] = 2;
+  DECODE(data, sizeof(data), SNAPSHOT_RESULT_BAD_VERSION);
+  data[0] = 'X';
+  DECODE(data, sizeof(data), SNAPSHOT_RESULT_BAD_MAGIC);
+}
+
+void test_files() {
+  char dir[] = "/tmp/snapshot_XXXXXX";
+  assert(mkdtemp(dir));
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/ezsp_router.snapshot", dir);
+
+  network_snapshot_t snapshot, read;
+  fill_snapshot(&snapshot);
+  assert(snapshot_read_file(path, &read) == SNAPSHOT_RESULT_IO_ERROR);
+  assert(snapshot_write_file(path, &snapshot) == SNAPSHOT_RESULT_OK);
+  assert(snapshot_read_file(path, &read) == SNAPSHOT_RESULT_OK);
+  assert_snapshots_equal(&snapshot, &read);
+
+  FILE *file = fopen(path, "ab");
+  fputc(0, file);
+  fclose(file);
+  assert(snapshot_read_file(path, &read) == SNAPSHOT_RESULT_BAD_LENGTH);
+
+  remove(path);
+  remove(dir);
+}
+
+int main() {
+  test_encode_decode();
+  test_files();
+}